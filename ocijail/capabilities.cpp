@@ -0,0 +1,161 @@
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "ocijail/capabilities.h"
+
+namespace fs = std::filesystem;
+
+using nlohmann::json;
+
+namespace ocijail {
+
+namespace {
+
+// The jail parameters which create may use
+const char* probed_jail_params[] = {
+    "allow.chflags",
+    "allow.mount.devfs",
+    "allow.mount.nullfs",
+    "allow.mount.tmpfs",
+    "allow.raw_sockets",
+    "children.max",
+    "enforce_statfs",
+    "vnet",
+};
+
+// Identifies the running kernel. A reboot changes the boot time and a new
+// kernel normally changes the version string.
+json kernel_key() {
+    timeval boottime{};
+    size_t len = sizeof(boottime);
+    if (::sysctlbyname("kern.boottime", &boottime, &len, nullptr, 0) < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "reading kern.boottime"};
+    }
+    std::string version;
+    len = 0;
+    if (::sysctlbyname("kern.version", nullptr, &len, nullptr, 0) == 0) {
+        version.resize(len);
+        auto data = version.data();
+        if (::sysctlbyname("kern.version", data, &len, nullptr, 0) < 0) {
+            len = 0;
+        }
+        version.resize(strnlen(data, len));
+    }
+    return {{"boottime", {boottime.tv_sec, boottime.tv_usec}},
+            {"version", version}};
+}
+
+std::vector<std::string> probe_fstypes() {
+    std::vector<std::string> res;
+    size_t len = 0;
+    if (::sysctlbyname("vfs.conflist", nullptr, &len, nullptr, 0) < 0) {
+        return res;
+    }
+    std::vector<xvfsconf> conf(len / sizeof(xvfsconf));
+    len = conf.size() * sizeof(xvfsconf);
+    if (::sysctlbyname("vfs.conflist", conf.data(), &len, nullptr, 0) < 0) {
+        return res;
+    }
+    conf.resize(len / sizeof(xvfsconf));
+    for (auto& vfc : conf) {
+        res.emplace_back(vfc.vfc_name);
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+std::vector<std::string> probe_jail_params() {
+    std::vector<std::string> res;
+    for (auto name : probed_jail_params) {
+        auto mib = std::string{"security.jail.param."} + name;
+        size_t len = 0;
+        if (::sysctlbyname(mib.c_str(), nullptr, &len, nullptr, 0) == 0) {
+            res.emplace_back(name);
+        }
+    }
+    return res;
+}
+
+// The cache file, or empty if it can't be used
+fs::path cache_path(main_app& app) {
+    if (app.get_test_mode() != test_mode::NONE ||
+        !fs::is_directory(app.get_state_db())) {
+        return {};
+    }
+    return app.get_state_db() / ".capabilities";
+}
+
+void save(main_app& app, const host_capabilities& caps) {
+    auto path = cache_path(app);
+    if (path.empty()) {
+        return;
+    }
+    try {
+        auto cache = kernel_key();
+        cache["fstypes"] = caps.fstypes;
+        cache["jail_params"] = caps.jail_params;
+        if (caps.file_mounts) {
+            cache["file_mounts"] = *caps.file_mounts;
+        }
+        auto tmp = path;
+        tmp += "." + std::to_string(::getpid());
+        {
+            std::ofstream out{tmp};
+            out << cache.dump();
+            if (!out) {
+                throw std::runtime_error("writing " + tmp.native());
+            }
+        }
+        fs::rename(tmp, path);
+    } catch (const std::exception& e) {
+        OCIJAIL_LOG_DEBUG(app).field("error", e.what())
+            << "saving host capabilities failed";
+    }
+}
+
+}  // namespace
+
+host_capabilities host_capabilities::load(main_app& app) {
+    host_capabilities caps;
+    auto path = cache_path(app);
+    if (!path.empty() && fs::is_regular_file(path)) {
+        try {
+            mapped_file file{path};
+            auto cache = json::parse(file.contents());
+            auto key = kernel_key();
+            if (cache.at("boottime") == key["boottime"] &&
+                cache.at("version") == key["version"]) {
+                cache.at("fstypes").get_to(caps.fstypes);
+                cache.at("jail_params").get_to(caps.jail_params);
+                if (cache.contains("file_mounts")) {
+                    caps.file_mounts = cache["file_mounts"].get<bool>();
+                }
+                return caps;
+            }
+        } catch (const std::exception& e) {
+            OCIJAIL_LOG_DEBUG(app).field("error", e.what())
+                << "loading host capabilities failed";
+        }
+    }
+    caps.fstypes = probe_fstypes();
+    caps.jail_params = probe_jail_params();
+    save(app, caps);
+    return caps;
+}
+
+void host_capabilities::record_file_mounts(main_app& app, bool supported) {
+    if (file_mounts == supported) {
+        return;
+    }
+    file_mounts = supported;
+    save(app, *this);
+}
+
+}  // namespace ocijail
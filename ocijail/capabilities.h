@@ -0,0 +1,31 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ocijail/main.h"
+
+namespace ocijail {
+
+// Facts about the host which we would otherwise discover on every create.
+// They are kept in .capabilities in the state database along with the
+// kernel's boot time and version and are probed again if either changes.
+struct host_capabilities {
+    // Whether nullfs can mount a file, which is only known after the first
+    // file mount has been tried
+    std::optional<bool> file_mounts;
+    // The file system types known to the kernel and the jail parameters we
+    // use which it supports, when probed. These are reported by features.
+    std::vector<std::string> fstypes;
+    std::vector<std::string> jail_params;
+
+    // Return the recorded capabilities, probing and recording them if they
+    // are missing or out of date
+    static host_capabilities load(main_app& app);
+
+    // Record whether file mounts work, if that isn't already known
+    void record_file_mounts(main_app& app, bool supported);
+};
+
+}  // namespace ocijail
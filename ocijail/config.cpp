@@ -0,0 +1,555 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <span>
+#include <system_error>
+
+#include "ocijail/config.h"
+#include "ocijail/schema.h"
+
+using nlohmann::json;
+
+namespace ocijail {
+
+mapped_file::mapped_file(const std::filesystem::path& path) {
+    auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "opening " + path.string()};
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        auto err = errno;
+        ::close(fd);
+        throw std::system_error{
+            err, std::system_category(), "reading " + path.string()};
+    }
+    // An empty file can't be mapped but still needs to be reported as a
+    // parse error by the caller.
+    size_ = st.st_size;
+    if (size_ > 0) {
+        auto p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            auto err = errno;
+            ::close(fd);
+            throw std::system_error{
+                err, std::system_category(), "mapping " + path.string()};
+        }
+        data_ = static_cast<const char*>(p);
+    }
+    ::close(fd);
+}
+
+mapped_file::~mapped_file() {
+    if (data_) {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+namespace {
+
+// A field which is kept when pruning a document. An empty list of children
+// keeps everything below the field.
+struct kept_field {
+    std::string_view name;
+    std::span<const kept_field> children;
+};
+
+constexpr kept_field process_fields[] = {
+    {"terminal", {}},
+    {"cwd", {}},
+    {"args", {}},
+    {"env", {}},
+    {"user", {}},
+};
+
+constexpr kept_field config_fields[] = {
+    {"ociVersion", {}},
+    {"process", process_fields},
+    {"root", {}},
+    {"hostname", {}},
+    {"mounts", {}},
+    {"hooks", {}},
+    {"annotations", {}},
+};
+
+// A SAX handler which builds a json document containing only the fields we
+// use. Values of other fields are consumed without being stored. This is
+// modelled on nlohmann's json_sax_dom_parser.
+class pruning_sax {
+   public:
+    using number_integer_t = json::number_integer_t;
+    using number_unsigned_t = json::number_unsigned_t;
+    using number_float_t = json::number_float_t;
+    using string_t = json::string_t;
+    using binary_t = json::binary_t;
+
+    pruning_sax(json& root, std::span<const kept_field> fields)
+        : root_(root), next_fields_(fields) {}
+
+    bool null() {
+        handle_value(nullptr);
+        return true;
+    }
+    bool boolean(bool val) {
+        handle_value(val);
+        return true;
+    }
+    bool number_integer(number_integer_t val) {
+        handle_value(val);
+        return true;
+    }
+    bool number_unsigned(number_unsigned_t val) {
+        handle_value(val);
+        return true;
+    }
+    bool number_float(number_float_t val, const string_t&) {
+        handle_value(val);
+        return true;
+    }
+    bool string(string_t& val) {
+        handle_value(std::move(val));
+        return true;
+    }
+    bool binary(binary_t& val) {
+        handle_value(std::move(val));
+        return true;
+    }
+
+    bool start_object(std::size_t) { return start(json::object()); }
+    bool end_object() { return end(); }
+    bool start_array(std::size_t) { return start(json::array()); }
+    bool end_array() { return end(); }
+
+    bool key(string_t& val) {
+        if (skip_depth_ > 0) {
+            return true;
+        }
+        auto fields = stack_.back().fields;
+        if (!fields.empty()) {
+            auto it = std::find_if(
+                fields.begin(), fields.end(), [&](auto& field) {
+                    return field.name == val;
+                });
+            if (it == fields.end()) {
+                skip_next_ = true;
+                return true;
+            }
+            next_fields_ = it->children;
+        } else {
+            next_fields_ = {};
+        }
+        object_element_ = &(*stack_.back().value)[val];
+        return true;
+    }
+
+    // Rethrow with the concrete exception type, as the DOM parser does
+    template <typename Exception>
+    bool parse_error(std::size_t, const std::string&, const Exception& ex) {
+        throw ex;
+    }
+
+   private:
+    struct container {
+        json* value;
+        std::span<const kept_field> fields;
+    };
+
+    template <typename Value>
+    json* handle_value(Value&& v) {
+        if (skip_next_) {
+            skip_next_ = false;
+            return nullptr;
+        }
+        if (skip_depth_ > 0) {
+            return nullptr;
+        }
+        if (stack_.empty()) {
+            root_ = json(std::forward<Value>(v));
+            return &root_;
+        }
+        auto parent = stack_.back().value;
+        if (parent->is_array()) {
+            parent->emplace_back(std::forward<Value>(v));
+            return &parent->back();
+        }
+        *object_element_ = json(std::forward<Value>(v));
+        return object_element_;
+    }
+
+    bool start(json value) {
+        if (skip_next_ || skip_depth_ > 0) {
+            skip_next_ = false;
+            skip_depth_++;
+            return true;
+        }
+        // Array elements are filtered in the same way as the array itself.
+        auto fields = next_fields_;
+        if (!stack_.empty() && stack_.back().value->is_array()) {
+            fields = stack_.back().fields;
+        }
+        stack_.push_back({handle_value(std::move(value)), fields});
+        return true;
+    }
+
+    bool end() {
+        if (skip_depth_ > 0) {
+            skip_depth_--;
+        } else {
+            stack_.pop_back();
+        }
+        return true;
+    }
+
+    json& root_;
+    std::vector<container> stack_;
+    std::span<const kept_field> next_fields_;
+    json* object_element_{nullptr};
+    bool skip_next_{false};
+    int skip_depth_{0};
+};
+
+json parse_pruned(std::string_view text, std::span<const kept_field> fields) {
+    json res;
+    pruning_sax sax{res, fields};
+    json::sax_parse(text.begin(), text.end(), &sax);
+    return res;
+}
+
+}  // namespace
+
+// The parts of the OCI runtime-spec schema which we support. Unknown fields
+// are ignored, as the spec requires.
+namespace oci_schema {
+
+using enum json_type;
+
+constexpr schema user_uid{NUMBER, "process.user.uid must be a number"};
+constexpr schema user_gid{NUMBER, "process.user.gid must be a number"};
+constexpr schema user_umask{NUMBER, "process.user.umask must be a number"};
+constexpr schema user_additional_gid{
+    NUMBER, "process.user.additionalGids must be an array of numbers"};
+constexpr schema user_additional_gids{
+    .type = ARRAY,
+    .type_error = "process.user.additionalGids must be an array",
+    .values = &user_additional_gid,
+};
+constexpr schema_field user_fields[] = {
+    {"uid", &user_uid, "process.user.uid must be a number"},
+    {"gid", &user_gid, "process.user.gid must be a number"},
+    {"umask", &user_umask},
+    {"additionalGids", &user_additional_gids},
+};
+constexpr schema user{
+    .type = OBJECT,
+    .type_error = "process.user must be an object",
+    .nullable = true,
+    .fields = schema_fields(user_fields),
+};
+
+constexpr schema process_cwd{STRING, "process.cwd must be a string"};
+constexpr schema process_arg{STRING,
+                             "process.args must be an array of strings"};
+constexpr schema process_args{
+    .type = ARRAY,
+    .type_error = "process.args must be an array",
+    .values = &process_arg,
+    .min_items = 1,
+    .min_items_error = "process.args must have at least one element",
+};
+constexpr schema process_env_var{STRING,
+                                 "process.env must be an array of strings"};
+constexpr schema process_env{
+    .type = ARRAY,
+    .type_error = "process.env must be an array",
+    .values = &process_env_var,
+};
+constexpr schema process_terminal{BOOLEAN,
+                                  "process.terminal must be a boolean"};
+constexpr schema_field process_fields[] = {
+    {"cwd", &process_cwd, "no process.cwd"},
+    {"args", &process_args, "no process.args"},
+    {"env", &process_env},
+    {"user", &user},
+    {"terminal", &process_terminal},
+};
+constexpr schema process{
+    .type = OBJECT,
+    .type_error = "process must be an object",
+    .fields = schema_fields(process_fields),
+};
+
+constexpr schema root_path{STRING, "root.path must be a string"};
+constexpr schema root_readonly{BOOLEAN, "root.readonly must be a boolean"};
+constexpr schema_field root_fields[] = {
+    {"path", &root_path},
+    {"readonly", &root_readonly},
+};
+constexpr schema root{
+    .type = OBJECT,
+    .type_error = "root must be an object",
+    .fields = schema_fields(root_fields),
+};
+
+constexpr schema mount_destination{STRING,
+                                   "mount destination must be a string"};
+constexpr schema mount_source{STRING,
+                              "if present, mount source must be a string"};
+constexpr schema mount_type{STRING, "if present, mount type must be a string"};
+constexpr schema mount_option{
+    STRING, "if present, mount options must be an array of strings"};
+constexpr schema mount_options{
+    .type = ARRAY,
+    .type_error = "if present, mount options must be an array",
+    .values = &mount_option,
+};
+constexpr schema_field mount_fields[] = {
+    {"destination",
+     &mount_destination,
+     "mount destination must be a string"},
+    {"source", &mount_source},
+    {"type", &mount_type},
+    {"options", &mount_options},
+};
+constexpr schema mount{
+    .type = OBJECT,
+    .type_error = "mounts must be an array of objects",
+    .fields = schema_fields(mount_fields),
+};
+constexpr schema mounts{
+    .type = ARRAY,
+    .type_error = "mounts must be an array",
+    .nullable = true,
+    .values = &mount,
+};
+
+constexpr schema hook_path{STRING, "hook.path must be a string"};
+constexpr schema hook_arg{STRING, "hook.args elements must be strings"};
+constexpr schema hook_args{
+    .type = ARRAY,
+    .type_error = "hook.args must be an array",
+    .values = &hook_arg,
+};
+constexpr schema hook_env_var{STRING, "hook.env elements must be strings"};
+constexpr schema hook_env{
+    .type = ARRAY,
+    .type_error = "hook.env must be an array",
+    .values = &hook_env_var,
+};
+constexpr schema hook_timeout{NUMBER, "hook.timeout must be a number"};
+constexpr schema_field hook_fields[] = {
+    {"path", &hook_path, "hook must have a path property"},
+    {"args", &hook_args},
+    {"env", &hook_env},
+    {"timeout", &hook_timeout},
+};
+constexpr schema hook{
+    .type = OBJECT,
+    .type_error = "hook must have a path property",
+    .fields = schema_fields(hook_fields),
+};
+constexpr schema hook_list{
+    .type = ARRAY,
+    .type_error = "hook lists must be arrays",
+    .values = &hook,
+};
+constexpr schema_field hooks_fields[] = {
+    {"prestart", &hook_list},
+    {"createRuntime", &hook_list},
+    {"createContainer", &hook_list},
+    {"startContainer", &hook_list},
+    {"poststart", &hook_list},
+    {"poststop", &hook_list},
+};
+constexpr schema hooks{
+    .type = OBJECT,
+    .type_error = "hooks must be an object",
+    .nullable = true,
+    .fields = schema_fields(hooks_fields),
+};
+
+constexpr schema annotation{STRING, "annotation values must be strings"};
+constexpr schema annotations{
+    .type = OBJECT,
+    .type_error = "annotations must be an object",
+    .values = &annotation,
+};
+
+constexpr schema oci_version{STRING, "ociVersion must be a string"};
+constexpr schema hostname{STRING, "hostname must be a string"};
+constexpr schema_field config_fields[] = {
+    {"ociVersion", &oci_version, "no ociVersion"},
+    {"process", &process},
+    {"root", &root},
+    {"hostname", &hostname},
+    {"mounts", &mounts},
+    {"hooks", &hooks},
+    {"annotations", &annotations},
+};
+constexpr schema config{
+    .type = OBJECT,
+    .type_error = "config must be an object",
+    .fields = schema_fields(config_fields),
+};
+
+}  // namespace oci_schema
+
+// The functions below extract values from documents which have already been
+// validated.
+
+static oci_user extract_user(const json& user) {
+    oci_user res;
+    for (auto& [key, value] : user.items()) {
+        if (key == "uid") {
+            res.uid = value;
+        } else if (key == "gid") {
+            res.gid = value;
+        } else if (key == "umask") {
+            res.umask = value;
+        } else if (key == "additionalGids") {
+            res.additional_gids = value.get<std::vector<gid_t>>();
+        }
+    }
+    return res;
+}
+
+static oci_process extract_process(const json& process) {
+    oci_process res;
+    for (auto& [key, value] : process.items()) {
+        if (key == "cwd") {
+            res.cwd = value;
+        } else if (key == "args") {
+            res.args = value.get<std::vector<std::string>>();
+        } else if (key == "env") {
+            res.env = value.get<std::vector<std::string>>();
+        } else if (key == "user") {
+            if (!value.is_null()) {
+                res.user = extract_user(value);
+            }
+        } else if (key == "terminal") {
+            res.terminal = value;
+        }
+    }
+    return res;
+}
+
+static oci_root extract_root(const json& root) {
+    oci_root res;
+    for (auto& [key, value] : root.items()) {
+        if (key == "path") {
+            res.path = value.get<std::string>();
+        } else if (key == "readonly") {
+            res.readonly = value;
+        }
+    }
+    return res;
+}
+
+static oci_mount extract_mount(const json& mount) {
+    oci_mount res;
+    for (auto& [key, value] : mount.items()) {
+        if (key == "destination") {
+            res.destination = value;
+        } else if (key == "source") {
+            res.source = value;
+        } else if (key == "type") {
+            res.type = value;
+        } else if (key == "options") {
+            res.options = value.get<std::vector<std::string>>();
+        }
+    }
+    return res;
+}
+
+static oci_hook extract_hook(const json& hook) {
+    oci_hook res;
+    for (auto& [key, value] : hook.items()) {
+        if (key == "path") {
+            res.path = value;
+        } else if (key == "args") {
+            res.args = value.get<std::vector<std::string>>();
+        } else if (key == "env") {
+            res.env = value.get<std::vector<std::string>>();
+        } else if (key == "timeout") {
+            res.timeout = value;
+        }
+    }
+    return res;
+}
+
+static oci_hooks extract_hooks(const json& hooks) {
+    static const std::pair<const char*, std::vector<oci_hook> oci_hooks::*>
+        phases[] = {
+            {"prestart", &oci_hooks::prestart},
+            {"createRuntime", &oci_hooks::create_runtime},
+            {"createContainer", &oci_hooks::create_container},
+            {"startContainer", &oci_hooks::start_container},
+            {"poststart", &oci_hooks::poststart},
+            {"poststop", &oci_hooks::poststop},
+        };
+
+    oci_hooks res;
+    for (auto& [phase, member] : phases) {
+        auto it = hooks.find(phase);
+        if (it == hooks.end()) {
+            continue;
+        }
+        auto& list = res.*member;
+        list.reserve(it->size());
+        for (auto& hook : *it) {
+            list.push_back(extract_hook(hook));
+        }
+    }
+    return res;
+}
+
+static oci_config extract_config(const json& config) {
+    oci_config res;
+    for (auto& [key, value] : config.items()) {
+        if (key == "ociVersion") {
+            res.oci_version = value;
+        } else if (key == "process") {
+            res.process = extract_process(value);
+        } else if (key == "root") {
+            res.root = extract_root(value);
+        } else if (key == "hostname") {
+            res.hostname = value;
+        } else if (key == "mounts") {
+            if (value.is_null()) {
+                continue;
+            }
+            res.mounts.reserve(value.size());
+            for (auto& mount : value) {
+                res.mounts.push_back(extract_mount(mount));
+            }
+        } else if (key == "hooks") {
+            if (!value.is_null()) {
+                res.hooks = extract_hooks(value);
+            }
+        } else if (key == "annotations") {
+            res.annotations = value.get<decltype(res.annotations)>();
+        }
+    }
+    return res;
+}
+
+oci_process oci_process::parse(const json& process) {
+    validate(process, oci_schema::process);
+    return extract_process(process);
+}
+
+oci_process oci_process::parse(std::string_view text) {
+    return parse(parse_pruned(text, process_fields));
+}
+
+oci_config oci_config::parse(const json& config) {
+    validate(config, oci_schema::config);
+    return extract_config(config);
+}
+
+oci_config oci_config::parse(std::string_view text) {
+    return parse(parse_pruned(text, config_fields));
+}
+
+}  // namespace ocijail
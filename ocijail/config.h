@@ -0,0 +1,107 @@
+#pragma once
+
+#include <sys/types.h>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+namespace ocijail {
+
+// A read-only private mapping of a bundle file, used to parse json without
+// going through iostreams.
+class mapped_file {
+   public:
+    explicit mapped_file(const std::filesystem::path& path);
+    ~mapped_file();
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    std::string_view contents() const { return {data_, size_}; }
+
+   private:
+    const char* data_{nullptr};
+    size_t size_{0};
+};
+
+// Typed copies of the parts of the OCI runtime configuration which we use.
+// Each parse function walks its json object once, validating as it goes and
+// calling malformed_config for anything which is not well-formed. Unknown
+// fields are ignored. When parsing from text, subtrees of unknown fields are
+// skipped by the SAX parser and never added to a json document.
+
+struct oci_user {
+    uid_t uid{0};
+    gid_t gid{0};
+    std::optional<mode_t> umask;
+    std::vector<gid_t> additional_gids;
+};
+
+struct oci_process {
+    bool terminal{false};
+    std::string cwd;
+    std::vector<std::string> args;
+    std::vector<std::string> env;
+    oci_user user;
+
+    // Used for both the process in a bundle config and for exec
+    static oci_process parse(const nlohmann::json& json);
+    // Parse the text of an exec process.json, skipping unused fields
+    static oci_process parse(std::string_view text);
+};
+
+struct oci_root {
+    std::optional<std::filesystem::path> path;
+    bool readonly{false};
+};
+
+struct oci_mount {
+    std::string destination;
+    std::optional<std::string> source;
+    std::optional<std::string> type;
+    std::vector<std::string> options;
+};
+
+struct oci_hook {
+    std::string path;
+    std::optional<std::vector<std::string>> args;
+    std::optional<std::vector<std::string>> env;
+    std::optional<int> timeout;
+};
+
+struct oci_hooks {
+    std::vector<oci_hook> prestart;
+    std::vector<oci_hook> create_runtime;
+    std::vector<oci_hook> create_container;
+    std::vector<oci_hook> start_container;
+    std::vector<oci_hook> poststart;
+    std::vector<oci_hook> poststop;
+};
+
+struct oci_config {
+    std::string oci_version;
+    std::optional<oci_process> process;
+    std::optional<oci_root> root;
+    std::optional<std::string> hostname;
+    std::vector<oci_mount> mounts;
+    oci_hooks hooks;
+    std::map<std::string, std::string, std::less<>> annotations;
+
+    static oci_config parse(const nlohmann::json& json);
+    // Parse the text of a config.json, skipping unused fields
+    static oci_config parse(std::string_view text);
+
+    std::optional<std::string_view> annotation(std::string_view key) const {
+        auto it = annotations.find(key);
+        if (it == annotations.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+};
+
+}  // namespace ocijail
@@ -0,0 +1,321 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ocijail/copy.h"
+
+namespace ocijail {
+
+namespace {
+
+[[noreturn]] void throw_copy_error(const char* name) {
+    throw std::system_error{
+        errno, std::system_category(), std::string{"copying "} + name};
+}
+
+// Copy the data of one open file to another, returning the number of bytes
+// copied. If used_read_write is set, it records whether copy_file_range had
+// to be abandoned.
+uint64_t copy_data(int in,
+                   int out,
+                   const char* name,
+                   bool* used_read_write = nullptr) {
+    uint64_t bytes = 0;
+    for (;;) {
+        auto n = ::copy_file_range(in, nullptr, out, nullptr, SSIZE_MAX, 0);
+        if (n > 0) {
+            bytes += n;
+            continue;
+        }
+        if (n == 0) {
+            return bytes;
+        }
+        // Fall back to read and write if the kernel or file system can't
+        // copy this file
+        if (bytes == 0 && (errno == EINVAL || errno == EXDEV ||
+                           errno == ENOSYS || errno == EOPNOTSUPP)) {
+            break;
+        }
+        throw_copy_error(name);
+    }
+    if (used_read_write) {
+        *used_read_write = true;
+    }
+    char buf[65536];
+    for (;;) {
+        auto n = ::read(in, buf, sizeof(buf));
+        if (n < 0) {
+            throw_copy_error(name);
+        }
+        if (n == 0) {
+            return bytes;
+        }
+        for (ssize_t done = 0; done < n;) {
+            auto m = ::write(out, buf + done, n - done);
+            if (m < 0) {
+                throw_copy_error(name);
+            }
+            done += m;
+        }
+        bytes += n;
+    }
+}
+
+// Copies a tree a directory at a time. Each worker copies the directories it
+// finds itself unless the queue is short, in which case they are queued for
+// other workers. This keeps the number of open descriptors bounded while
+// giving idle workers something to do.
+class tree_copier {
+   public:
+    explicit tree_copier(size_t jobs) : jobs_(std::max(jobs, size_t(1))) {}
+
+    copy_stats run(int src_dirfd, int dst_dirfd) {
+        auto src = ::fcntl(src_dirfd, F_DUPFD_CLOEXEC, 0);
+        auto dst = src < 0 ? -1 : ::fcntl(dst_dirfd, F_DUPFD_CLOEXEC, 0);
+        if (dst < 0) {
+            auto err = errno;
+            if (src >= 0) {
+                ::close(src);
+            }
+            throw std::system_error{err, std::system_category(), "dup"};
+        }
+        queue_.push_back({src, dst});
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < jobs_; i++) {
+            try {
+                threads.emplace_back([this] { worker(); });
+            } catch (const std::system_error&) {
+                break;
+            }
+        }
+        worker();
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (auto& j : queue_) {
+            ::close(j.src);
+            ::close(j.dst);
+        }
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return totals_;
+    }
+
+   private:
+    struct job {
+        int src;
+        int dst;
+    };
+
+    void worker() {
+        std::unique_lock lk{mutex_};
+        for (;;) {
+            cv_.wait(lk, [&] {
+                return error_ || !queue_.empty() || running_ == 0;
+            });
+            if (error_ || queue_.empty()) {
+                break;
+            }
+            auto j = queue_.front();
+            queue_.pop_front();
+            running_++;
+            lk.unlock();
+
+            copy_stats stats;
+            std::exception_ptr e;
+            try {
+                copy_dir(j.src, j.dst, stats);
+            } catch (...) {
+                e = std::current_exception();
+            }
+
+            lk.lock();
+            running_--;
+            totals_.files += stats.files;
+            totals_.bytes += stats.bytes;
+            if (e && !error_) {
+                error_ = e;
+            }
+            cv_.notify_all();
+        }
+    }
+
+    // Hand a directory to another worker if there is room in the queue,
+    // taking ownership of the descriptors
+    bool share(int src, int dst) {
+        std::lock_guard lk{mutex_};
+        if (jobs_ == 1 || queue_.size() >= jobs_) {
+            return false;
+        }
+        queue_.push_back({src, dst});
+        cv_.notify_one();
+        return true;
+    }
+
+    // Copy the contents of src to dst, closing both descriptors
+    void copy_dir(int src, int dst, copy_stats& stats) {
+        fd_guard dst_guard{dst};
+        std::unique_ptr<DIR, int (*)(DIR*)> dir{::fdopendir(src), ::closedir};
+        if (!dir) {
+            ::close(src);
+            throw std::system_error{
+                errno, std::system_category(), "reading directory"};
+        }
+        src = ::dirfd(dir.get());
+        while (auto ent = ::readdir(dir.get())) {
+            std::string_view name = ent->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            copy_entry(src, dst, ent->d_name, stats);
+        }
+    }
+
+    void copy_entry(int src, int dst, const char* name, copy_stats& stats) {
+        struct stat st;
+        if (::fstatat(src, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            throw_copy_error(name);
+        }
+        auto mode = st.st_mode & 07777;
+        if (S_ISDIR(st.st_mode)) {
+            if (::mkdirat(dst, name, 0700) < 0) {
+                throw_copy_error(name);
+            }
+            fd_guard in{::openat(
+                src, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)};
+            fd_guard out{::openat(
+                dst, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)};
+            if (in.fd < 0 || out.fd < 0 ||
+                ::fchown(out.fd, st.st_uid, st.st_gid) < 0 ||
+                ::fchmod(out.fd, mode) < 0) {
+                throw_copy_error(name);
+            }
+            if (share(in.fd, out.fd)) {
+                in.fd = out.fd = -1;
+            } else {
+                copy_dir(std::exchange(in.fd, -1),
+                         std::exchange(out.fd, -1),
+                         stats);
+            }
+            return;
+        }
+        if (S_ISREG(st.st_mode)) {
+            fd_guard in{::openat(src, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)};
+            fd_guard out{::openat(dst,
+                                  name,
+                                  O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                                  0600)};
+            if (in.fd < 0 || out.fd < 0) {
+                throw_copy_error(name);
+            }
+            stats.bytes += copy_data(in.fd, out.fd, name);
+            // Set the mode last since writing may clear set-id bits
+            if (::fchown(out.fd, st.st_uid, st.st_gid) < 0 ||
+                ::fchmod(out.fd, mode) < 0) {
+                throw_copy_error(name);
+            }
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            auto n = ::readlinkat(src, name, target, sizeof(target) - 1);
+            if (n < 0) {
+                throw_copy_error(name);
+            }
+            target[n] = 0;
+            if (::symlinkat(target, dst, name) < 0 ||
+                ::fchownat(
+                    dst, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) < 0) {
+                throw_copy_error(name);
+            }
+        } else if (S_ISFIFO(st.st_mode)) {
+            if (::mkfifoat(dst, name, 0600) < 0 ||
+                ::fchownat(dst, name, st.st_uid, st.st_gid, 0) < 0 ||
+                ::fchmodat(dst, name, mode, 0) < 0) {
+                throw_copy_error(name);
+            }
+        } else {
+            errno = ENOTSUP;
+            throw_copy_error(name);
+        }
+        stats.files++;
+    }
+
+    size_t jobs_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<job> queue_;
+    size_t running_ = 0;
+    copy_stats totals_;
+    std::exception_ptr error_;
+};
+
+}  // namespace
+
+copy_stats copy_tree(int src_dirfd, int dst_dirfd, size_t jobs) {
+    return tree_copier{jobs}.run(src_dirfd, dst_dirfd);
+}
+
+std::string_view to_string(copy_method method) {
+    switch (method) {
+    case copy_method::LINK:
+        return "link";
+    case copy_method::COPY_FILE_RANGE:
+        return "copy_file_range";
+    case copy_method::COPY:
+        return "copy";
+    }
+    return "unknown";
+}
+
+copy_method place_file(const std::filesystem::path& source,
+                       const std::filesystem::path& destination,
+                       bool allow_link) {
+    if (allow_link) {
+        if (::linkat(AT_FDCWD,
+                     source.c_str(),
+                     AT_FDCWD,
+                     destination.c_str(),
+                     AT_SYMLINK_FOLLOW) == 0) {
+            return copy_method::LINK;
+        }
+        // Other errors, e.g. a missing source, would stop a copy as well
+        if (errno != EXDEV && errno != EPERM && errno != EACCES &&
+            errno != EMLINK && errno != EOPNOTSUPP) {
+            throw_copy_error(source.c_str());
+        }
+    }
+
+    fd_guard in{::open(source.c_str(), O_RDONLY | O_CLOEXEC)};
+    struct stat st;
+    if (in.fd < 0 || ::fstat(in.fd, &st) < 0) {
+        throw_copy_error(source.c_str());
+    }
+    fd_guard out{::open(destination.c_str(),
+                        O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                        0600)};
+    if (out.fd < 0) {
+        throw_copy_error(destination.c_str());
+    }
+    bool used_read_write = false;
+    copy_data(in.fd, out.fd, destination.c_str(), &used_read_write);
+    if (::fchmod(out.fd, st.st_mode & 07777) < 0) {
+        throw_copy_error(destination.c_str());
+    }
+    return used_read_write ? copy_method::COPY : copy_method::COPY_FILE_RANGE;
+}
+
+}  // namespace ocijail
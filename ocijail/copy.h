@@ -0,0 +1,56 @@
+#pragma once
+
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+namespace ocijail {
+
+// Closes a descriptor when it goes out of scope
+struct fd_guard {
+    explicit fd_guard(int fd_) : fd(fd_) {}
+    ~fd_guard() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    fd_guard(const fd_guard&) = delete;
+    fd_guard& operator=(const fd_guard&) = delete;
+    int fd;
+};
+
+// Totals for a call to copy_tree. Directories are not counted as files.
+struct copy_stats {
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+};
+
+// Copy the contents of the directory src_dirfd into the directory dst_dirfd,
+// preserving ownership, modes and symbolic links. File data is copied with
+// copy_file_range where the kernel supports it and subdirectories are copied
+// on up to jobs threads. The descriptors are not closed and the ownership and
+// mode of dst_dirfd itself are left alone.
+copy_stats copy_tree(int src_dirfd, int dst_dirfd, size_t jobs);
+
+// The ways in which place_file can make a copy of a file, cheapest first
+enum class copy_method {
+    LINK,             // a hard link to the source
+    COPY_FILE_RANGE,  // an in-kernel copy, which may share blocks
+    COPY,             // read and write
+};
+
+std::string_view to_string(copy_method method);
+
+// Make destination, which must not exist, a copy of the regular file source
+// using the cheapest method which works. A hard link is only tried if
+// allow_link is set, since changes through either name are shared, and is
+// only possible on the same file system. Otherwise the data is copied with
+// copy_file_range, which clones blocks on file systems which support it,
+// falling back to read and write.
+copy_method place_file(const std::filesystem::path& source,
+                       const std::filesystem::path& destination,
+                       bool allow_link);
+
+}  // namespace ocijail
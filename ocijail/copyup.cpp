@@ -0,0 +1,543 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "ocijail/config.h"
+#include "ocijail/copyup.h"
+
+namespace fs = std::filesystem;
+
+namespace ocijail {
+
+namespace {
+
+constexpr char MAGIC[4] = {'o', 'c', 'c', 'u'};
+constexpr uint32_t VERSION = 1;
+
+// Archive records. A directory's entries follow its DIRECTORY record and end
+// with END.
+enum record : char {
+    DIRECTORY = 'd',
+    END = 'e',
+    REGULAR = 'f',
+    SYMLINK = 'l',
+    FIFO = 'p',
+};
+
+[[noreturn]] void throw_errno(const std::string& what) {
+    throw std::system_error{errno, std::system_category(), what};
+}
+
+// The names in a directory, sorted so that walks are repeatable
+std::vector<std::string> list_directory(int dirfd) {
+    auto fd = ::openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw_errno("reading directory");
+    }
+    std::unique_ptr<DIR, int (*)(DIR*)> dir{::fdopendir(fd), ::closedir};
+    if (!dir) {
+        ::close(fd);
+        throw_errno("reading directory");
+    }
+    std::vector<std::string> names;
+    while (auto ent = ::readdir(dir.get())) {
+        std::string_view name = ent->d_name;
+        if (name != "." && name != "..") {
+            names.emplace_back(name);
+        }
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+int open_directory(int dirfd, const std::string& name) {
+    auto fd = ::openat(
+        dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        throw_errno("opening " + name);
+    }
+    return fd;
+}
+
+// Remove everything in a directory, leaving the directory itself
+void clear_directory(int dirfd) {
+    for (auto& name : list_directory(dirfd)) {
+        struct stat st;
+        if (::fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            throw_errno("reading " + name);
+        }
+        int flags = 0;
+        if (S_ISDIR(st.st_mode)) {
+            fd_guard sub{open_directory(dirfd, name)};
+            clear_directory(sub.fd);
+            flags = AT_REMOVEDIR;
+        }
+        if (::unlinkat(dirfd, name.c_str(), flags) < 0) {
+            throw_errno("removing " + name);
+        }
+    }
+}
+
+// FNV-1a over the bytes of each value
+class hasher {
+   public:
+    template <typename T>
+    void add(const T& value) {
+        bytes(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    void add(std::string_view s) {
+        add(s.size());
+        bytes(s.data(), s.size());
+    }
+    uint64_t value() const { return h_; }
+
+   private:
+    void bytes(const char* p, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            h_ ^= uint8_t(p[i]);
+            h_ *= 0x100000001b3;
+        }
+    }
+    uint64_t h_ = 0xcbf29ce484222325;
+};
+
+void add_stat(hasher& h, const struct stat& st) {
+    h.add(uint64_t(st.st_mode));
+    h.add(uint64_t(st.st_uid));
+    h.add(uint64_t(st.st_gid));
+    h.add(uint64_t(st.st_size));
+    h.add(int64_t(st.st_mtim.tv_sec));
+    h.add(int64_t(st.st_mtim.tv_nsec));
+}
+
+void fingerprint_dir(hasher& h, int dirfd) {
+    for (auto& name : list_directory(dirfd)) {
+        struct stat st;
+        if (::fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            throw_errno("reading " + name);
+        }
+        h.add(std::string_view{name});
+        add_stat(h, st);
+        if (S_ISDIR(st.st_mode)) {
+            fd_guard sub{open_directory(dirfd, name)};
+            fingerprint_dir(h, sub.fd);
+            h.add(char(END));
+        }
+    }
+}
+
+// Writes an archive to a file through a small buffer so that memory use
+// doesn't depend on the size of the tree
+class archive_writer {
+   public:
+    archive_writer(int fd, uint64_t budget) : fd_(fd), budget_(budget) {}
+
+    template <typename T>
+    void put(const T& value) {
+        append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    void put(std::string_view s) {
+        put(uint32_t(s.size()));
+        append(s.data(), s.size());
+    }
+    void header(record kind, const std::string& name, const struct stat& st) {
+        put(kind);
+        put(uint32_t(st.st_mode & 07777));
+        put(uint32_t(st.st_uid));
+        put(uint32_t(st.st_gid));
+        put(std::string_view{name});
+    }
+
+    // Returns false if the archive would be over budget
+    bool pack_dir(int dirfd) {
+        for (auto& name : list_directory(dirfd)) {
+            struct stat st;
+            if (::fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                throw_errno("reading " + name);
+            }
+            if (S_ISDIR(st.st_mode)) {
+                header(DIRECTORY, name, st);
+                fd_guard sub{open_directory(dirfd, name)};
+                if (!pack_dir(sub.fd)) {
+                    return false;
+                }
+                put(END);
+            } else if (S_ISREG(st.st_mode)) {
+                header(REGULAR, name, st);
+                if (!pack_file(dirfd, name, st)) {
+                    return false;
+                }
+            } else if (S_ISLNK(st.st_mode)) {
+                char target[PATH_MAX];
+                auto n = ::readlinkat(
+                    dirfd, name.c_str(), target, sizeof(target));
+                if (n < 0) {
+                    throw_errno("reading " + name);
+                }
+                header(SYMLINK, name, st);
+                put(std::string_view{target, size_t(n)});
+            } else if (S_ISFIFO(st.st_mode)) {
+                header(FIFO, name, st);
+            } else {
+                // copy_tree doesn't make anything else
+                return false;
+            }
+            if (size_ > budget_) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void flush() {
+        auto data = std::string_view{buf_};
+        while (!data.empty()) {
+            auto n = ::write(fd_, data.data(), data.size());
+            if (n < 0) {
+                throw_errno("writing copy-up archive");
+            }
+            data.remove_prefix(n);
+        }
+        buf_.clear();
+    }
+
+   private:
+    static constexpr size_t buffer_size = 1 << 20;
+
+    void append(const char* p, size_t n) {
+        buf_.append(p, n);
+        size_ += n;
+        if (buf_.size() >= buffer_size) {
+            flush();
+        }
+    }
+
+    // The size recorded in the archive is the one we found when walking the
+    // tree, which was copied from the source by us and so can't change
+    // underneath us. Anything else is treated as an error.
+    bool pack_file(int dirfd, const std::string& name, const struct stat& st) {
+        if (size_ + st.st_size > budget_) {
+            return false;
+        }
+        fd_guard fd{::openat(dirfd, name.c_str(), O_RDONLY | O_CLOEXEC)};
+        if (fd.fd < 0) {
+            throw_errno("reading " + name);
+        }
+        put(uint64_t(st.st_size));
+        size_t left = st.st_size;
+        while (left > 0) {
+            auto start = buf_.size();
+            auto chunk = std::min(left, buffer_size);
+            buf_.resize(start + chunk);
+            auto n = ::read(fd.fd, &buf_[start], chunk);
+            if (n < 0) {
+                throw_errno("reading " + name);
+            }
+            if (n == 0) {
+                throw std::runtime_error(name + " changed while packing");
+            }
+            buf_.resize(start + n);
+            size_ += n;
+            left -= n;
+            if (buf_.size() >= buffer_size) {
+                flush();
+            }
+        }
+        return true;
+    }
+
+    int fd_;
+    uint64_t budget_;
+    // The number of bytes put so far, including any which are buffered
+    uint64_t size_ = 0;
+    std::string buf_;
+};
+
+class archive_reader {
+   public:
+    explicit archive_reader(std::string_view buf) : buf_(buf) {}
+
+    template <typename T>
+    T get() {
+        T value;
+        std::memcpy(&value, take(sizeof(value)).data(), sizeof(value));
+        return value;
+    }
+    std::string_view get_string() { return take(get<uint32_t>()); }
+
+    std::string_view take(size_t n) {
+        if (n > buf_.size()) {
+            throw std::runtime_error("truncated copy-up archive");
+        }
+        auto res = buf_.substr(0, n);
+        buf_.remove_prefix(n);
+        return res;
+    }
+
+    bool empty() const { return buf_.empty(); }
+
+   private:
+    std::string_view buf_;
+};
+
+struct entry_header {
+    record kind;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    std::string name;
+};
+
+// Read the records of an archive, calling fn for each of them along with
+// its data (file contents or link target). END records have no header
+// fields. The whole archive is read with a no-op fn before unpacking so
+// that a damaged archive is rejected before anything is created.
+template <typename Fn>
+void read_archive(std::string_view data, Fn&& fn) {
+    archive_reader reader{data};
+    if (reader.take(sizeof(MAGIC)) != std::string_view{MAGIC, 4} ||
+        reader.get<uint32_t>() != VERSION) {
+        throw std::runtime_error("bad copy-up archive");
+    }
+    size_t depth = 0;
+    while (!reader.empty()) {
+        entry_header h;
+        h.kind = reader.get<record>();
+        std::string_view contents;
+        if (h.kind == END) {
+            if (depth == 0) {
+                throw std::runtime_error("bad copy-up archive");
+            }
+            depth--;
+        } else {
+            h.mode = reader.get<uint32_t>();
+            h.uid = reader.get<uint32_t>();
+            h.gid = reader.get<uint32_t>();
+            h.name = reader.get_string();
+            if (h.name.empty() || h.name == "." || h.name == ".." ||
+                h.name.find('/') != std::string::npos) {
+                throw std::runtime_error("bad copy-up archive");
+            }
+            switch (h.kind) {
+            case DIRECTORY:
+                depth++;
+                break;
+            case REGULAR:
+                contents = reader.take(reader.get<uint64_t>());
+                break;
+            case SYMLINK:
+                contents = reader.get_string();
+                break;
+            case FIFO:
+                break;
+            default:
+                throw std::runtime_error("bad copy-up archive");
+            }
+        }
+        fn(h, contents);
+    }
+    if (depth != 0) {
+        throw std::runtime_error("truncated copy-up archive");
+    }
+}
+
+copy_stats unpack(std::string_view data, int dst_dirfd) {
+    read_archive(data, [](auto&, auto) {});
+
+    copy_stats stats;
+    std::vector<int> dirs{dst_dirfd};
+    auto fail = [&](const std::string& name) {
+        auto err = errno;
+        for (size_t i = 1; i < dirs.size(); i++) {
+            ::close(dirs[i]);
+        }
+        throw std::system_error{
+            err, std::system_category(), "restoring " + name};
+    };
+    read_archive(data, [&](const entry_header& h, std::string_view contents) {
+        auto dirfd = dirs.back();
+        auto name = h.name.c_str();
+        switch (h.kind) {
+        case END:
+            ::close(dirfd);
+            dirs.pop_back();
+            return;
+        case DIRECTORY: {
+            if (::mkdirat(dirfd, name, 0700) < 0) {
+                fail(h.name);
+            }
+            auto fd = ::openat(
+                dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                fail(h.name);
+            }
+            dirs.push_back(fd);
+            if (::fchown(fd, h.uid, h.gid) < 0 || ::fchmod(fd, h.mode) < 0) {
+                fail(h.name);
+            }
+            return;
+        }
+        case REGULAR: {
+            fd_guard fd{::openat(dirfd,
+                                 name,
+                                 O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                                 0600)};
+            if (fd.fd < 0) {
+                fail(h.name);
+            }
+            while (!contents.empty()) {
+                auto n = ::write(fd.fd, contents.data(), contents.size());
+                if (n < 0) {
+                    fail(h.name);
+                }
+                stats.bytes += n;
+                contents.remove_prefix(n);
+            }
+            if (::fchown(fd.fd, h.uid, h.gid) < 0 ||
+                ::fchmod(fd.fd, h.mode) < 0) {
+                fail(h.name);
+            }
+            break;
+        }
+        case SYMLINK: {
+            std::string target{contents};
+            if (::symlinkat(target.c_str(), dirfd, name) < 0 ||
+                ::fchownat(
+                    dirfd, name, h.uid, h.gid, AT_SYMLINK_NOFOLLOW) < 0) {
+                fail(h.name);
+            }
+            break;
+        }
+        case FIFO:
+            if (::mkfifoat(dirfd, name, 0600) < 0 ||
+                ::fchownat(dirfd, name, h.uid, h.gid, 0) < 0 ||
+                ::fchmodat(dirfd, name, h.mode, 0) < 0) {
+                fail(h.name);
+            }
+            break;
+        }
+        stats.files++;
+    });
+    return stats;
+}
+
+}  // namespace
+
+copyup_cache::copyup_cache(const fs::path& state_db, uint64_t budget)
+    : state_db_(state_db), budget_(budget) {}
+
+uint64_t copyup_cache::fingerprint(int dirfd) {
+    hasher h;
+    struct stat st;
+    if (::fstat(dirfd, &st) < 0) {
+        throw_errno("reading copy-up source");
+    }
+    add_stat(h, st);
+    fingerprint_dir(h, dirfd);
+    return h.value();
+}
+
+fs::path copyup_cache::archive_path(uint64_t fingerprint) const {
+    char name[32];
+    ::snprintf(name,
+               sizeof(name),
+               ".copyup-%016llx",
+               static_cast<unsigned long long>(fingerprint));
+    return state_db_ / name;
+}
+
+std::optional<copy_stats> copyup_cache::restore(uint64_t fingerprint,
+                                                int dst_dirfd) {
+    auto path = archive_path(fingerprint);
+    if (!fs::is_regular_file(path)) {
+        return std::nullopt;
+    }
+    try {
+        mapped_file archive{path};
+        auto stats = unpack(archive.contents(), dst_dirfd);
+        // The modification time of an archive records when it was last used
+        ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+        return stats;
+    } catch (...) {
+        // The archive may be damaged or may have just been evicted. Make
+        // sure that it can't fail again and leave dst_dirfd ready for a
+        // copy.
+        std::error_code ec;
+        fs::remove(path, ec);
+        clear_directory(dst_dirfd);
+        throw;
+    }
+}
+
+void copyup_cache::store(uint64_t fingerprint, int src_dirfd) {
+    auto path = archive_path(fingerprint);
+    auto tmp = path;
+    tmp += "." + std::to_string(::getpid());
+    fd_guard fd{::open(
+        tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)};
+    if (fd.fd < 0) {
+        throw_errno("creating " + tmp.native());
+    }
+    try {
+        archive_writer writer{fd.fd, budget_};
+        writer.put(MAGIC);
+        writer.put(VERSION);
+        if (!writer.pack_dir(src_dirfd)) {
+            fs::remove(tmp);
+            return;
+        }
+        writer.flush();
+        fs::rename(tmp, path);
+    } catch (...) {
+        std::error_code ec;
+        fs::remove(tmp, ec);
+        throw;
+    }
+    evict();
+}
+
+void copyup_cache::evict() {
+    struct archive {
+        fs::path path;
+        fs::file_time_type used;
+        uintmax_t size;
+    };
+    std::vector<archive> archives;
+    uintmax_t total = 0;
+    for (auto& entry : fs::directory_iterator{state_db_}) {
+        auto name = entry.path().filename().native();
+        // Skip files which are still being written
+        if (!name.starts_with(".copyup-") || name.find('.', 1) != name.npos) {
+            continue;
+        }
+        std::error_code ec;
+        auto used = entry.last_write_time(ec);
+        auto size = entry.file_size(ec);
+        if (!ec) {
+            archives.push_back({entry.path(), used, size});
+            total += size;
+        }
+    }
+    std::sort(archives.begin(), archives.end(), [](auto& a, auto& b) {
+        return a.used < b.used;
+    });
+    for (auto& a : archives) {
+        if (total <= budget_) {
+            break;
+        }
+        std::error_code ec;
+        fs::remove(a.path, ec);
+        total -= a.size;
+    }
+}
+
+}  // namespace ocijail
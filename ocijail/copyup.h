@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+
+#include "ocijail/copy.h"
+
+namespace ocijail {
+
+// Packed copies of the trees copied by the tmpcopyup mount option, kept in
+// .copyup-<fingerprint> files in the state database so that a tree which
+// is copied up often can be restored with one sequential read instead of a
+// walk which opens each file in the image.
+//
+// The fingerprint covers the name, size, mode, owner and modification time
+// of everything in the source tree, which only needs the directory entries
+// and their attributes rather than the file data. Device and inode numbers
+// are left out so that the same image in each container's clone of a root
+// shares an archive. Archives are written as the tree is walked and are
+// removed least recently used first when their total size is over budget.
+class copyup_cache {
+   public:
+    copyup_cache(const std::filesystem::path& state_db, uint64_t budget);
+
+    static uint64_t fingerprint(int dirfd);
+
+    // Unpack the archive for a fingerprint into dst_dirfd, if there is one.
+    // If that fails, the archive is removed and dst_dirfd is emptied before
+    // the error is rethrown.
+    std::optional<copy_stats> restore(uint64_t fingerprint, int dst_dirfd);
+
+    // Pack the contents of src_dirfd as the archive for a fingerprint, unless
+    // it is bigger than the budget, and remove old archives if necessary
+    void store(uint64_t fingerprint, int src_dirfd);
+
+   private:
+    std::filesystem::path archive_path(uint64_t fingerprint) const;
+    void evict();
+
+    std::filesystem::path state_db_;
+    uint64_t budget_;
+};
+
+}  // namespace ocijail
@@ -10,7 +10,10 @@
 #include "ocijail/create.h"
 #include "ocijail/hook.h"
 #include "ocijail/jail.h"
+#include "ocijail/journal.h"
+#include "ocijail/monitor.h"
 #include "ocijail/mount.h"
+#include "ocijail/plan.h"
 #include "ocijail/process.h"
 #include "ocijail/tty.h"
 
@@ -60,6 +63,49 @@ oci_version parse_version(std::string ociver) {
 
 namespace ocijail {
 
+// Parse and validate the bundle config text. Configs which pass are saved as
+// plans in the state database so that later creates from the same bundle
+// can skip this.
+static oci_config load_config(main_app& app, std::string_view text) {
+    std::optional<bundle_plan> plan;
+    if (app.get_test_mode() == test_mode::NONE &&
+        fs::is_directory(app.get_state_db())) {
+        plan.emplace(app.get_state_db(), text);
+        try {
+            if (auto config = plan->load()) {
+                OCIJAIL_LOG_DEBUG(app) << "using cached bundle plan";
+                return std::move(*config);
+            }
+        } catch (const std::exception& e) {
+            OCIJAIL_LOG_DEBUG(app).field("error", e.what())
+                << "loading bundle plan failed";
+        }
+    }
+
+    auto config = oci_config::parse(text);
+
+    // Allow 1.0.x, 1.1.x and 1.2.x
+    auto ver = parse_version(config.oci_version);
+    if (ver.major != "1" || !(ver.minor == "0" || ver.minor == "1" || ver.minor == "2")) {
+        throw std::runtime_error{"create: unsupported OCI version " +
+                                 config.oci_version};
+    }
+
+    if (!config.process) {
+        malformed_config("no process");
+    }
+
+    if (plan) {
+        try {
+            plan->store(config);
+        } catch (const std::exception& e) {
+            OCIJAIL_LOG_DEBUG(app).field("error", e.what())
+                << "saving bundle plan failed";
+        }
+    }
+    return config;
+}
+
 void create::init(main_app& app) {
     static create instance{app};
 }
@@ -86,11 +132,15 @@ create::create(main_app& app) : app_(app) {
     sub->add_option("--preserve-fds",
                     preserve_fds_,
                     "Number of additional file descriptors for the container");
+    sub->add_flag("--monitor",
+                  monitor_,
+                  "Record the container's exit status using a monitor process");
 
     sub->final_callback([this] { run(); });
 }
 
 void create::run() {
+    auto create_span = app_.trace("create", {{"id", id_}});
     auto state = app_.get_runtime_state(id_);
 
     if (app_.get_test_mode() == test_mode::NONE && state.exists()) {
@@ -109,42 +159,22 @@ void create::run() {
         throw std::runtime_error{
             "create: bundle directory must contain config.json"};
     }
-    json config;
-    std::ifstream{config_path} >> config;
-
-    if (!config.contains("ociVersion")) {
-        malformed_config("no ociVersion");
-    }
-    if (!config["ociVersion"].is_string()) {
-        malformed_config("ociVersion must be a string");
-    }
-    // Allow 1.0.x, 1.1.x and 1.2.x
-    auto ver = parse_version(config["ociVersion"]);
-    if (ver.major != "1" || !(ver.minor == "0" || ver.minor == "1" || ver.minor == "2")) {
-        throw std::runtime_error{"create: unsupported OCI version " +
-                                 std::string{config["ociVersion"]}};
-    }
-
-    if (!config.contains("process")) {
-        malformed_config("no process");
-    }
+    auto parse_span = app_.trace("parse config");
+    mapped_file config_file{config_path};
+    auto config = load_config(app_, config_file.contents());
 
-    auto& config_process = config["process"];
-    process proc{config_process, console_socket_, true, preserve_fds_};
+    process proc{*config.process, console_socket_, true, preserve_fds_};
 
     // If the config contains a root path, use that, otherwise the
     // bundle directory must have a subdirectory named "root"
     bool root_readonly = false;
     auto root_path = bundle_path_ / "root";
     auto readonly_root_path = state.get_state_dir() / "readonly_root";
-    if (config.contains("root")) {
-        auto& config_root = config["root"];
-        if (config["root"].contains("path")) {
-            root_path = fs::path{config_root["path"]};
-        }
-        if (config_root.contains("readonly") && config_root["readonly"]) {
-            root_readonly = true;
+    if (config.root) {
+        if (config.root->path) {
+            root_path = *config.root->path;
         }
+        root_readonly = config.root->readonly;
     }
     if (!fs::is_directory(root_path)) {
         std::stringstream ss;
@@ -152,61 +182,6 @@ void create::run() {
         throw std::runtime_error{ss.str()};
     }
 
-    // Validate mounts if present
-    auto& config_mounts = config["mounts"];
-    if (!config_mounts.is_null()) {
-        if (!config_mounts.is_array()) {
-            malformed_config("mounts must be an array");
-        }
-        for (auto& mount : config_mounts) {
-            if (!mount.is_object()) {
-                malformed_config("mounts must be an array of objects");
-            }
-            if (!mount["destination"].is_string()) {
-                malformed_config("mount destination must be a string");
-            }
-            if (mount.contains("source")) {
-                if (!mount["source"].is_string()) {
-                    malformed_config(
-                        "if present, mount source must be a string");
-                }
-            }
-            if (mount.contains("type")) {
-                if (!mount["type"].is_string()) {
-                    malformed_config("if present, mount type must be a string");
-                }
-            }
-            if (mount.contains("options")) {
-                if (!mount["options"].is_array()) {
-                    malformed_config(
-                        "if present, mount options must be an array");
-                }
-                for (auto& opt : mount["options"]) {
-                    if (!opt.is_string()) {
-                        malformed_config(
-                            "if present, mount options must be an array of "
-                            "strings");
-                    }
-                }
-            }
-        }
-    }
-
-    // Validate hooks, if present
-    auto& config_hooks = config["hooks"];
-    if (!config_hooks.is_null()) {
-        if (!config_hooks.is_object()) {
-            malformed_config("hooks must be an object");
-        }
-
-        hook::validate_hooks(app_, config_hooks, "prestart");
-        hook::validate_hooks(app_, config_hooks, "createRuntime");
-        hook::validate_hooks(app_, config_hooks, "createContainer");
-        hook::validate_hooks(app_, config_hooks, "startContainer");
-        hook::validate_hooks(app_, config_hooks, "poststart");
-        hook::validate_hooks(app_, config_hooks, "poststop");
-    }
-
     // Default to setting allow.chflags but disable if we have a
     // parent jail where this is not set.
     bool allow_chflags = true;
@@ -214,23 +189,28 @@ void create::run() {
     // Get the parent jail name and requested vnet type (if any)
     std::optional<std::string> parent_jail;
     auto vnet = jail::INHERIT;
-    if (config.contains("annotations")) {
-        auto config_annotations = config["annotations"];
-        if (config_annotations.contains("org.freebsd.parentJail")) {
-            parent_jail = config_annotations["org.freebsd.parentJail"];
-            auto pj = jail::find(*parent_jail);
-            allow_chflags = pj.get<bool>("allow.chflags");
+    if (auto val = config.annotation("org.freebsd.parentJail")) {
+        parent_jail = *val;
+        auto pj = jail::find(*parent_jail);
+        allow_chflags = pj.get<bool>("allow.chflags");
+    }
+    if (auto val = config.annotation("org.freebsd.jail.vnet")) {
+        if (*val == "new") {
+            vnet = jail::NEW;
+        } else if (*val == "inherit") {
+            vnet = jail::INHERIT;
+        } else {
+            throw std::runtime_error("bad value for org.freebsd.jail.vnet: " +
+                                     std::string{*val});
         }
-        if (config_annotations.contains("org.freebsd.jail.vnet")) {
-            std::string val = config_annotations["org.freebsd.jail.vnet"];
-            if (val == "new") {
-                vnet = jail::NEW;
-            } else if (val == "inherit") {
-                vnet = jail::INHERIT;
-            } else {
-                throw std::runtime_error(
-                    "bad value for org.freebsd.jail.vnet: " + val);
-            }
+    }
+    if (auto val = config.annotation("org.freebsd.ocijail.monitor")) {
+        if (*val == "true") {
+            monitor_ = true;
+        } else if (*val != "false") {
+            throw std::runtime_error(
+                "bad value for org.freebsd.ocijail.monitor: " +
+                std::string{*val});
         }
     }
 
@@ -258,23 +238,28 @@ void create::run() {
         jconf.set("ip4", jail::INHERIT);
         jconf.set("ip6", jail::INHERIT);
     }
-    if (config.contains("hostname")) {
-        jconf.set("host.hostname", config["hostname"].get<std::string>());
+    if (config.hostname) {
+        jconf.set("host.hostname", *config.hostname);
         jconf.set("host", jail::NEW);
     } else {
         jconf.set("host", jail::INHERIT);
     }
 
+    parse_span.end();
+
     // Unit tests for config validation stop here.
     if (app_.get_test_mode() == test_mode::VALIDATION) {
         return;
     }
 
     // Create a state object with initial fields from the config
-    state["root_path"] = root_path;
-    state["bundle"] = bundle_path_;
-    state["config"] = config;
-    state["status"] = "created";
+    state.set_root_path(root_path);
+    state.set_bundle(bundle_path_);
+    state.set_config(std::string{config_file.contents()}, config);
+    state.set_status(container_status::CREATED);
+    if (monitor_) {
+        state.set_monitored();
+    }
     if (parent_jail) {
         state["parent_jail"] = *parent_jail;
     }
@@ -283,33 +268,34 @@ void create::run() {
     auto lk = state.create();
 
     // Mount filesystems if requested and record unmount actions in the
-    // state.
+    // mount journal.
     //
     // If rootfs needs to be remounted read-only, we make two passes. The first
     // prepares mount points and the second completes the mounts in our
     // read-only alias.
     state["root_readonly"] = false;
     if (root_readonly) {
-        if (config_mounts.is_array()) {
-            mount_volumes(app_, state, root_path, true, config_mounts);
-        }
+        mount_volumes(app_, state, root_path, true, config.mounts);
+        auto span = app_.trace("mount readonly root");
         fs::create_directory(readonly_root_path);
         std::vector<std::tuple<std::string, std::string>> mount_opts;
         mount_opts.emplace_back("fstype", "nullfs");
         mount_opts.emplace_back("fspath", readonly_root_path);
         mount_opts.emplace_back("target", root_path);
+        mount_journal journal{state.get_state_dir()};
+        journal.open();
+        journal.mount(readonly_root_path);
         if (do_mount(mount_opts, MNT_RDONLY) < 0) {
             throw std::system_error(errno,
                                     std::system_category(),
                                     "mounting " + readonly_root_path.native());
         }
+        journal.mounted(readonly_root_path);
         root_path = readonly_root_path;
         state["root_readonly"] = true;
         state["readonly_root_path"] = readonly_root_path;
     }
-    if (config_mounts.is_array()) {
-        mount_volumes(app_, state, root_path, false, config_mounts);
-    }
+    mount_volumes(app_, state, root_path, false, config.mounts);
 
     // Create the jail for our container. If we have a parent, attach
     // to that first.
@@ -330,7 +316,9 @@ void create::run() {
             errno, std::system_category(), "error creating socket pair"};
     }
 
+    auto jail_span = app_.trace("jail::create");
     auto j = jail::create(jconf);
+    jail_span.end();
 
     // We record the container state including the bundle config. We
     // need to create the start fifo before forking - this will be
@@ -348,16 +336,26 @@ void create::run() {
         if (pid_file_) {
             std::ofstream{*pid_file_} << pid;
         }
-        state["jid"] = j.jid();
-        state["pid"] = pid;
+        state.set_jid(j.jid());
+        state.set_pid(pid);
+        auto save_span = app_.trace("save state");
         state.save();
+        save_span.end();
 
-        hook::run_hooks(app_, config_hooks, "createRuntime", state);
+        // The monitor waits for the state lock so it will not record
+        // anything until we have finished creating the container.
+        if (monitor_) {
+            state.update_monitor_pid(start_monitor(state, pid));
+        }
+
+        hook::run_hooks(
+            app_, config.hooks.create_runtime, "createRuntime", state);
 
         lk.unlock();
 
         // Signal the child to execute any hooks and validate that the
         // container process can be found.
+        auto handshake_span = app_.trace("create handshake");
         char ch = 1;
         auto n = ::write(create_sock[0], &ch, 1);
         if (n < 0) {
@@ -373,13 +371,14 @@ void create::run() {
             throw std::system_error{
                 errno, std::system_category(), "read from create socket"};
         }
+        handshake_span.end();
         if (status != 0) {
             // If the create failed, we need to clean up: unmount the volumes and
             // delete the state.
             j.remove();
-            if (config_mounts.is_array()) {
-                unmount_volumes(app_, state, root_path, config_mounts);
-            }
+            unmount_volumes(app_, state, root_path, config.mounts);
+            // The journal has already removed the read-only root unless the
+            // state was written by an older version.
             if (root_readonly) {
                 if (::unmount(root_path.c_str(), MNT_FORCE) > 0) {
                     throw std::system_error{errno,
@@ -389,8 +388,14 @@ void create::run() {
             }
             state.remove_all();
         }
+        // exit doesn't unwind the stack so end the span here
+        create_span.end();
+        app_.finish(status);
         ::exit(status);
     } else {
+        // The parent records the overall create span
+        create_span.cancel();
+
         // Perform the console-socket hand off if process.terminal is true.
         auto [stdin_fd, stdout_fd, stderr_fd] = proc.pre_start();
 
@@ -410,6 +415,7 @@ void create::run() {
         }
 
         char status = 0;
+        auto child_span = app_.trace("create child");
         try {
             // Our part of create: execute any hooks, enter the jail and
             // validate process args.
@@ -429,18 +435,25 @@ void create::run() {
                     std::system_category(),
                     "error changing directory to" + root_path.string()};
             }
-            hook::run_hooks(app_, config_hooks, "createContainer", state);
+            hook::run_hooks(app_,
+                            config.hooks.create_container,
+                            "createContainer",
+                            state);
 
             // Enter the jail and set the requested working directory.
+            auto attach_span = app_.trace("jail attach");
             j.attach();
+            attach_span.end();
 
             // Validate the process executable exists and can be executed
+            auto validate_span = app_.trace("validate process");
             proc.validate();
         } catch (const std::exception& e) {
             std::string_view msg{e.what()};
             ::write(2, msg.data(), msg.size());
             status = 1;
         }
+        child_span.end();
 
         n = write(create_sock[1], &status, 1);
         if (n < 0) {
@@ -465,7 +478,8 @@ void create::run() {
         ::close(start_wait_fd);
 
         // Run startContainer hooks inside the jail.
-        hook::run_hooks(app_, config_hooks, "startContainer", state);
+        hook::run_hooks(
+            app_, config.hooks.start_container, "startContainer", state);
 
         // Execute the requested process inside the jail.
         proc.exec(stdin_fd, stdout_fd, stderr_fd);
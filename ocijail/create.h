@@ -24,6 +24,7 @@ struct create {
     std::optional<std::filesystem::path> console_socket_;
     std::optional<std::filesystem::path> pid_file_;
     int preserve_fds_{0};
+    bool monitor_{false};
 };
 
 }  // namespace ocijail
@@ -40,6 +40,7 @@ void delete_::run() {
         return;
     }
 
+    auto span = app_.trace("delete", {{"id", id_}});
     auto lk = state.lock();
     state.load();
 
@@ -55,35 +56,39 @@ void delete_::run() {
     //   force flag is set, send it a KILL signal and delete it.
     //
     // We follow the more restrictive crun behaviour.
-    if (state["status"] == "stopped") {
+    auto status = state.status();
+    if (status == container_status::STOPPED) {
         // Nothing to do here
-    } else if (state["status"] == "created") {
-        ::kill(state["pid"], SIGKILL);
-    } else if (state["status"] == "running" && force_) {
-        ::kill(state["pid"], SIGKILL);
+    } else if (status == container_status::CREATED) {
+        ::kill(state.pid(), SIGKILL);
+    } else if (status == container_status::RUNNING && force_) {
+        ::kill(state.pid(), SIGKILL);
     } else {
         std::stringstream ss;
         ss << "delete: container not in \"stopped\" or \"created\" state "
-              "(currently "
-           << state["status"] << ")";
+              "(currently \""
+           << status_name(status) << "\")";
         throw std::runtime_error(ss.str());
     }
 
-    auto j = jail::find(int(state["jid"]));
+    auto jail_span = app_.trace("jail remove");
+    auto j = jail::find(state.jid());
     j.remove();
+    jail_span.end();
 
     bool root_readonly = false;
     if (state.contains("root_readonly")) {
         root_readonly = state["root_readonly"];
     }
-    fs::path root_path = state["root_path"];
+    auto root_path = state.root_path();
     if (root_readonly) {
         root_path = fs::path{state["readonly_root_path"]};
     }
-    if (state["config"].contains("mounts") &&
-        !state["config"]["mounts"].is_null()) {
-        unmount_volumes(app_, state, root_path, state["config"]["mounts"]);
-    }
+    // The mount journal lets this undo the mounts, including the read-only
+    // root, without looking at the config or the container's root. States
+    // written by older versions fall back to the mounts in the config.
+    auto& config = state.config();
+    unmount_volumes(app_, state, root_path, config.mounts);
     if (root_readonly) {
         if (::unmount(root_path.c_str(), MNT_FORCE) > 0) {
             throw std::system_error{errno,
@@ -92,7 +97,7 @@ void delete_::run() {
         }
     }
 
-    hook::run_hooks(app_, state["config"]["hooks"], "poststop", state);
+    hook::run_hooks(app_, config.hooks.poststop, "poststop", state);
 
     state.remove_all();
 }
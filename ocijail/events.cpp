@@ -0,0 +1,255 @@
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <set>
+
+#include "nlohmann/json.hpp"
+
+#include "ocijail/events.h"
+
+namespace fs = std::filesystem;
+
+using nlohmann::json;
+
+namespace ocijail {
+
+state_watcher::state_watcher(main_app& app, std::optional<std::string> id)
+    : app_(app), id_(id) {
+    fs::create_directories(app_.get_state_db());
+    db_watch_ = notifier_.watch_path(app_.get_state_db());
+}
+
+void state_watcher::run(const std::function<bool(const transition&)>& fn) {
+    if (!scan(fn)) {
+        return;
+    }
+    for (;;) {
+        auto ev = notifier_.wait();
+        if (!ev) {
+            continue;
+        }
+        if (ev->kind == notifier::event::PROCESS_EXIT) {
+            auto it = pids_.find(ev->ident);
+            if (it == pids_.end()) {
+                continue;
+            }
+            auto id = it->second;
+            pids_.erase(it);
+            auto e = entries_.find(id);
+            if (e != entries_.end()) {
+                e->second.process_exited = true;
+                e->second.exit_status = ev->status;
+            }
+            if (!update(id, fn)) {
+                return;
+            }
+        } else if (ev->ident == db_watch_) {
+            if (!scan(fn)) {
+                return;
+            }
+        } else {
+            auto it = watches_.find(ev->ident);
+            if (it == watches_.end()) {
+                continue;
+            }
+            // Take a copy - update may remove the watch
+            auto id = it->second;
+            if (!update(id, fn)) {
+                return;
+            }
+        }
+    }
+}
+
+bool state_watcher::scan(const std::function<bool(const transition&)>& fn) {
+    // Look for new containers and containers which have been deleted
+    std::set<std::string> ids;
+    if (id_) {
+        if (fs::is_directory(app_.get_state_db() / *id_)) {
+            ids.insert(*id_);
+        }
+    } else {
+        for (const auto& it : fs::directory_iterator{app_.get_state_db()}) {
+            if (it.is_directory()) {
+                ids.insert(it.path().filename().native());
+            }
+        }
+    }
+    for (auto& [id, e] : entries_) {
+        ids.insert(id);
+    }
+    for (auto& id : ids) {
+        if (!update(id, fn)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void state_watcher::unwatch(entry& e) {
+    for (auto w : {e.dir_watch, e.status_watch}) {
+        if (w) {
+            notifier_.unwatch_path(*w);
+            watches_.erase(*w);
+        }
+    }
+    e.dir_watch.reset();
+    e.status_watch.reset();
+}
+
+bool state_watcher::update(const std::string& id,
+                           const std::function<bool(const transition&)>& fn) {
+    auto state = app_.get_runtime_state(id);
+    auto it = entries_.try_emplace(id).first;
+
+    // Watch the container directory so that we see the status record being
+    // created or replaced.
+    if (!it->second.dir_watch) {
+        try {
+            auto w = notifier_.watch_path(state.get_state_dir());
+            it->second.dir_watch = w;
+            watches_[w] = id;
+        } catch (const std::system_error&) {
+            // The directory has gone, or is still being created and we will
+            // try again on the next update
+        }
+    }
+
+    bool loaded = false;
+    if (state.exists()) {
+        try {
+            state.load_snapshot();
+            state.check_status();
+            loaded = true;
+        } catch (const std::exception&) {
+            // Deleted while we were reading it
+        }
+    }
+    if (!loaded) {
+        if (fs::is_directory(state.get_state_dir())) {
+            // Still being created or in the middle of being deleted - we
+            // will be back when something changes.
+            return true;
+        }
+        bool reported = it->second.reported;
+        unwatch(it->second);
+        entries_.erase(it);
+        if (!reported) {
+            return true;
+        }
+        return fn(transition{id, std::nullopt, -1, -1});
+    }
+
+    auto& e = it->second;
+
+    // Status updates are made in place so watch the record itself. Saving
+    // the state replaces the file so re-establish the watch each time.
+    if (e.status_watch) {
+        notifier_.unwatch_path(*e.status_watch);
+        watches_.erase(*e.status_watch);
+        e.status_watch.reset();
+    }
+    try {
+        auto w = notifier_.watch_path(state.get_state_dir() / "status");
+        e.status_watch = w;
+        watches_[w] = id;
+    } catch (const std::system_error&) {
+        // Replaced or deleted since we read it - we will see the
+        // directory change.
+    }
+
+    auto status = state.status();
+    if ((status == container_status::CREATED ||
+         status == container_status::RUNNING) &&
+        !e.process_watched) {
+        e.process_watched = true;
+        if (notifier_.watch_process(state.pid())) {
+            pids_[state.pid()] = id;
+        } else {
+            // Exited before we could watch it. check_status leaves this to
+            // the monitor, if there is one and it is still running.
+            state.check_status();
+            status = state.status();
+        }
+    }
+    if (state.monitored()) {
+        e.exit_status = state.exit_status();
+    } else if (e.process_exited && (status == container_status::CREATED ||
+                                    status == container_status::RUNNING)) {
+        // The process may not have been reaped yet in which case
+        // check_status still believes it is alive.
+        status = container_status::STOPPED;
+    }
+
+    if (e.reported && e.status == status) {
+        return true;
+    }
+    e.reported = true;
+    e.status = status;
+    e.pid = state.pid();
+    return fn(transition{id,
+                         status,
+                         e.pid,
+                         status == container_status::STOPPED ? e.exit_status
+                                                              : -1});
+}
+
+static std::string event_timestamp() {
+    struct ::timeval tv;
+    struct std::tm now;
+    gettimeofday(&tv, nullptr);
+    gmtime_r(&tv.tv_sec, &now);
+    std::stringstream ss;
+    ss << std::put_time(&now, "%Y-%m-%dT%H:%M:%S") << "." << std::setw(6)
+       << std::setfill('0') << tv.tv_usec << "Z";
+    return ss.str();
+}
+
+json transition_json(const state_watcher::transition& t) {
+    json res;
+    res["time"] = event_timestamp();
+    res["id"] = t.id;
+    if (t.status) {
+        res["status"] = status_name(*t.status);
+        if (*t.status != container_status::STOPPED) {
+            res["pid"] = t.pid;
+        }
+    } else {
+        res["status"] = "deleted";
+    }
+    if (t.exit_status != -1) {
+        if (WIFEXITED(t.exit_status)) {
+            res["exitCode"] = WEXITSTATUS(t.exit_status);
+        } else if (WIFSIGNALED(t.exit_status)) {
+            res["exitCode"] = 128 + WTERMSIG(t.exit_status);
+        }
+    }
+    return res;
+}
+
+void events::init(main_app& app) {
+    static events instance{app};
+}
+
+events::events(main_app& app) : app_(app) {
+    auto sub = app.add_subcommand(
+        "events",
+        "Stream container status changes as newline-delimited json");
+    sub->add_option("container-id",
+                    id_,
+                    "Unique identifier for the container (default: all "
+                    "containers)");
+    sub->final_callback([this] { run(); });
+}
+
+void events::run() {
+    state_watcher watcher{app_, id_};
+    watcher.run([](const auto& t) {
+        std::cout << transition_json(t) << std::endl;
+        return true;
+    });
+}
+
+}  // namespace ocijail
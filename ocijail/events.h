@@ -0,0 +1,73 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <optional>
+
+#include "ocijail/main.h"
+#include "ocijail/notify.h"
+
+namespace ocijail {
+
+// Follow the status of one container or of every container in the state
+// database. Rather than polling, this waits for the container processes to
+// exit and for the state files to change.
+class state_watcher {
+   public:
+    struct transition {
+        std::string id;
+        // std::nullopt if the container was deleted
+        std::optional<container_status> status;
+        int pid;
+        // The wait status if the container has stopped and it is known,
+        // otherwise -1
+        int exit_status;
+    };
+
+    state_watcher(main_app& app, std::optional<std::string> id);
+
+    // Call fn with the current status of each container and then with each
+    // change in status until fn returns false.
+    void run(const std::function<bool(const transition&)>& fn);
+
+   private:
+    struct entry {
+        container_status status;
+        int pid;
+        int exit_status{-1};
+        bool reported{false};
+        bool process_watched{false};
+        bool process_exited{false};
+        std::optional<int> dir_watch;
+        std::optional<int> status_watch;
+    };
+
+    bool scan(const std::function<bool(const transition&)>& fn);
+    bool update(const std::string& id,
+                const std::function<bool(const transition&)>& fn);
+    void unwatch(entry& e);
+
+    main_app& app_;
+    std::optional<std::string> id_;
+    notifier notifier_;
+    int db_watch_;
+    std::map<std::string, entry> entries_;
+    std::map<int, std::string> watches_;
+    std::map<pid_t, std::string> pids_;
+};
+
+// Convert a transition to the json object reported by events
+nlohmann::json transition_json(const state_watcher::transition& t);
+
+struct events {
+    static void init(main_app& app);
+
+   private:
+    events(main_app& app);
+    void run();
+
+    main_app& app_;
+    std::optional<std::string> id_;
+};
+
+}  // namespace ocijail
@@ -49,12 +49,12 @@ exec::exec(main_app& app) : app_(app) {
 }
 
 void exec::run() {
-    json process_json;
-    std::ifstream{process_} >> process_json;
+    mapped_file process_file{process_};
+    auto config = oci_process::parse(process_file.contents());
     if (tty_) {
-        process_json["terminal"] = *tty_;
+        config.terminal = *tty_;
     }
-    process proc{process_json, console_socket_, detach_, preserve_fds_};
+    process proc{config, console_socket_, detach_, preserve_fds_};
 
     // Unit tests for config validation stop here.
     if (app_.get_test_mode() == test_mode::VALIDATION) {
@@ -62,10 +62,9 @@ void exec::run() {
     }
 
     auto state = app_.get_runtime_state(id_);
-    auto lk = state.lock();
-    state.load();
+    state.load_snapshot();
 
-    auto j = jail::find(int(state["jid"]));
+    auto j = jail::find(state.jid());
 
     if (detach_) {
         // Create a socket pair for coordinating create activities with
@@ -104,6 +103,7 @@ void exec::run() {
                                         std::system_category(),
                                         "read from exec create socket"};
             }
+            app_.finish(status);
             ::exit(status);
         } else {
             // Setup the tty if requested
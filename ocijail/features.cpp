@@ -4,6 +4,7 @@
 #include "nlohmann/json.hpp"
 
 #include "features.h"
+#include "ocijail/capabilities.h"
 
 namespace fs = std::filesystem;
 
@@ -15,12 +16,23 @@ void features::init(main_app& app) {
     static features instance{app};
 }
 
-features::features(main_app& app) {
+features::features(main_app& app) : app_(app) {
     auto sub = app.add_subcommand("features",
                                   "Get the enabled feature set of the runtime");
     sub->final_callback([this] { run(); });
 }
 
+static std::string join(const std::vector<std::string>& names) {
+    std::string res;
+    for (auto& name : names) {
+        if (!res.empty()) {
+            res += ',';
+        }
+        res += name;
+    }
+    return res;
+}
+
 void features::run() {
     json features;
     static const char* hooks[] = {"prestart",
@@ -80,6 +92,15 @@ void features::run() {
         features["mountOptions"].push_back(opt);
     }
 
+    // Report what we know about the host. Whether file mounts work is only
+    // known once a create has tried one.
+    auto caps = host_capabilities::load(app_);
+    auto& annotations = features["annotations"];
+    annotations["org.freebsd.ocijail.fileMounts"] =
+        caps.file_mounts ? (*caps.file_mounts ? "true" : "false") : "unknown";
+    annotations["org.freebsd.ocijail.fstypes"] = join(caps.fstypes);
+    annotations["org.freebsd.ocijail.jailParams"] = join(caps.jail_params);
+
     std::cout << features;
 }
 
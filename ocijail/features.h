@@ -12,6 +12,8 @@ struct features {
    private:
     features(main_app& app);
     void run();
+
+    main_app& app_;
 };
 
 }  // namespace ocijail
@@ -9,86 +9,23 @@ using nlohmann::json;
 
 namespace ocijail {
 
-hook::hook(const json& hook_config) {
-    // We can assume that validate_hooks has ensured that this is well-formed
-    path_ = hook_config["path"];
-
-    if (hook_config.contains("args")) {
-        auto& config_args = hook_config["args"];
-        args_ = std::vector<std::string>();
-        for (auto& arg : config_args) {
-            args_->push_back(arg.get<std::string>());
-        }
-    }
-
-    if (hook_config.contains("env")) {
-        auto& config_env = hook_config["env"];
-        env_ = std::vector<std::string>();
-        for (auto& arg : config_env) {
-            env_->push_back(arg.get<std::string>());
-        }
-    }
-
-    if (hook_config.contains("timeout")) {
-        auto& config_timeout = hook_config["timeout"];
-        if (!config_timeout.is_number()) {
-            malformed_config("process.env must be a number");
-        }
-        timeout_ = config_timeout;
-    }
-}
-
-void hook::validate_hooks(main_app& app,
-                          const nlohmann::json& hooks,
-                          const char* phase) {
-    if (hooks.is_null() || !hooks.contains(phase)) {
-        return;
-    }
-    auto& a = hooks[phase];
-    if (!a.is_array()) {
-        malformed_config("hook lists must be arrays");
-    }
-    for (auto& hook : a) {
-        if (!hook.contains("path")) {
-            malformed_config("hook must have a path property");
-        }
-        if (hook.contains("args")) {
-            auto& args = hook["args"];
-            if (!args.is_array()) {
-                malformed_config("hook.args must be an array");
-            }
-            for (auto& s : args) {
-                if (!s.is_string()) {
-                    malformed_config("hook.args elements must be strings");
-                }
-            }
-        }
-        if (hook.contains("env")) {
-            auto& env = hook["env"];
-            if (!env.is_array()) {
-                malformed_config("hook.env must be an array");
-            }
-            for (auto& s : env) {
-                if (!s.is_string()) {
-                    malformed_config("hook.env elements must be strings");
-                }
-            }
-        }
-        if (hook.contains("timeout") && !hook["timeout"].is_number()) {
-            malformed_config("hook.timeout must be a number");
-        }
-    }
-}
+hook::hook(const oci_hook& config)
+    : path_(config.path),
+      args_(config.args),
+      env_(config.env),
+      timeout_(config.timeout) {}
 
 void hook::run_hooks(main_app& app,
-                     const nlohmann::json& hooks,
+                     const std::vector<oci_hook>& hooks,
                      const char* phase,
                      const runtime_state& state) {
-    if (hooks.is_null() || !hooks.contains(phase)) {
+    if (hooks.empty()) {
         return;
     }
 
-    for (auto& hook_config : hooks[phase]) {
+    auto span = app.trace(std::string{"hooks "} + phase);
+    for (auto& hook_config : hooks) {
+        app.count(metric_counter::HOOKS);
         hook(hook_config).run(app, state);
     }
 }
@@ -1,7 +1,6 @@
 #pragma once
 
-#include "nlohmann/json.hpp"
-
+#include "ocijail/config.h"
 #include "ocijail/main.h"
 
 namespace ocijail {
@@ -9,18 +8,12 @@ namespace ocijail {
 class main_app;
 
 struct hook {
-    // initialise with a json describing the hook from the config
-    hook(const nlohmann::json& hook_config);
-
-    // Given a hooks object, validate that each hook in the given
-    // phase is well-formed
-    static void validate_hooks(main_app& app,
-                               const nlohmann::json& hooks,
-                               const char* phase);
+    // initialise from a hook in the config
+    hook(const oci_hook& config);
 
     // Run all the hooks for a phase
     static void run_hooks(main_app& app,
-                          const nlohmann::json& hooks,
+                          const std::vector<oci_hook>& hooks,
                           const char* phase,
                           const runtime_state& state);
 
@@ -28,7 +21,7 @@ struct hook {
     int run(main_app& app, const runtime_state& state);
 
    private:
-    // Copied out from the json during parsing
+    // Copied out from the config
     std::string path_;
     std::optional<std::vector<std::string>> args_;
     std::optional<std::vector<std::string>> env_;
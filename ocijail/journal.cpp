@@ -0,0 +1,140 @@
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <system_error>
+
+#include "ocijail/config.h"
+#include "ocijail/journal.h"
+
+namespace fs = std::filesystem;
+
+using nlohmann::json;
+
+namespace ocijail {
+
+mount_journal::mount_journal(const fs::path& state_dir)
+    : path_(state_dir / "mounts.journal") {}
+
+mount_journal::~mount_journal() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+void mount_journal::open() {
+    if (fd_ >= 0) {
+        return;
+    }
+    fd_ = ::open(
+        path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd_ < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "opening " + path_.native()};
+    }
+}
+
+void mount_journal::mount(const fs::path& path) {
+    append({record::MOUNT, path});
+}
+
+void mount_journal::mounted(const fs::path& path) {
+    struct statfs st;
+    if (::statfs(path.c_str(), &st) < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "statfs " + path.native()};
+    }
+    append({record::MOUNTED,
+            path,
+            {},
+            std::array<int32_t, 2>{st.f_fsid.val[0], st.f_fsid.val[1]}});
+}
+
+void mount_journal::abandoned(const fs::path& path) {
+    append({record::ABANDONED, path});
+}
+
+void mount_journal::create_directory(const fs::path& path) {
+    append({record::DIRECTORY, path});
+}
+
+void mount_journal::create_file(const fs::path& path) {
+    append({record::FILE, path});
+}
+
+void mount_journal::save(const fs::path& path, const fs::path& saved_path) {
+    append({record::SAVE, path, saved_path});
+}
+
+void mount_journal::append(const record& r) {
+    if (fd_ < 0) {
+        throw std::logic_error("mount journal is not open");
+    }
+    auto line = json::array({std::string(1, r.kind), r.path.native()});
+    if (r.kind == record::SAVE) {
+        line.push_back(r.saved_path.native());
+    }
+    if (r.fsid) {
+        line.push_back((*r.fsid)[0]);
+        line.push_back((*r.fsid)[1]);
+    }
+    auto data = line.dump() + "\n";
+    // A single write to a file opened with O_APPEND isn't interleaved with
+    // writes from other threads.
+    auto n = ::write(fd_, data.data(), data.size());
+    if (n < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "writing " + path_.native()};
+    }
+    if (size_t(n) != data.size()) {
+        throw std::runtime_error("short write to " + path_.native());
+    }
+}
+
+std::vector<mount_journal::record> mount_journal::read() const {
+    std::vector<record> res;
+    mapped_file file{path_};
+    auto contents = file.contents();
+    for (;;) {
+        auto end = contents.find('\n');
+        if (end == std::string_view::npos) {
+            // Anything left is a record which was never finished
+            break;
+        }
+        auto line = json::parse(contents.substr(0, end));
+        contents.remove_prefix(end + 1);
+
+        auto kind = line.at(0).get<std::string>();
+        if (kind.size() != 1) {
+            throw std::runtime_error("bad mount journal record: " + kind);
+        }
+        auto& r = res.emplace_back();
+        r.kind = record::kind_t(kind[0]);
+        r.path = line.at(1).get<std::string>();
+        switch (r.kind) {
+        case record::MOUNT:
+        case record::ABANDONED:
+        case record::DIRECTORY:
+        case record::FILE:
+            break;
+        case record::MOUNTED:
+            r.fsid = {line.at(2).get<int32_t>(), line.at(3).get<int32_t>()};
+            break;
+        case record::SAVE:
+            r.saved_path = line.at(2).get<std::string>();
+            break;
+        default:
+            throw std::runtime_error("bad mount journal record: " + kind);
+        }
+    }
+    return res;
+}
+
+void mount_journal::clear() {
+    if (::truncate(path_.c_str(), 0) < 0 && errno != ENOENT) {
+        throw std::system_error{
+            errno, std::system_category(), "truncating " + path_.native()};
+    }
+}
+
+}  // namespace ocijail
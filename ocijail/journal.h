@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace ocijail {
+
+// A record of the changes made outside the container's state directory
+// while setting up its mounts, kept in mounts.journal in the state
+// directory so that they can be undone exactly, even if create was
+// interrupted. Each change is recorded before it is made, so replaying the
+// journal must allow for the last change of each kind not having happened.
+// A mount which fails is followed by an ABANDONED record so that only a
+// mount interrupted by a crash is left without its MOUNTED record.
+// Records are lines of json appended with a single write each so that
+// concurrent mounts can share the journal and a line cut short by a crash
+// is simply ignored. The journal isn't synced since mounts don't survive a
+// reboot either.
+class mount_journal {
+   public:
+    struct record {
+        enum kind_t : char {
+            // path is about to be mounted on
+            MOUNT = 'm',
+            // path was mounted on, with the file system id in fsid
+            MOUNTED = 'M',
+            // the mount on path failed and was not made
+            ABANDONED = 'a',
+            // path is about to be created as a directory or a file
+            DIRECTORY = 'd',
+            FILE = 'f',
+            // path is about to be moved to saved_path
+            SAVE = 's',
+        };
+        kind_t kind;
+        std::filesystem::path path;
+        std::filesystem::path saved_path;
+        std::optional<std::array<int32_t, 2>> fsid;
+    };
+
+    explicit mount_journal(const std::filesystem::path& state_dir);
+    ~mount_journal();
+    mount_journal(const mount_journal&) = delete;
+    mount_journal& operator=(const mount_journal&) = delete;
+
+    // Open the journal for adding records, creating it if necessary
+    void open();
+
+    void mount(const std::filesystem::path& path);
+    void mounted(const std::filesystem::path& path);
+    void abandoned(const std::filesystem::path& path);
+    void create_directory(const std::filesystem::path& path);
+    void create_file(const std::filesystem::path& path);
+    void save(const std::filesystem::path& path,
+              const std::filesystem::path& saved_path);
+
+    bool exists() const { return std::filesystem::exists(path_); }
+    // Return the complete records in the order they were added
+    std::vector<record> read() const;
+    // Forget the records once they have been undone. The empty journal is
+    // kept so that the container is still known to have one.
+    void clear();
+
+   private:
+    void append(const record& r);
+
+    std::filesystem::path path_;
+    int fd_ = -1;
+};
+
+}  // namespace ocijail
@@ -18,9 +18,15 @@ void kill::init(main_app& app) {
 
 kill::kill(main_app& app) : app_(app) {
     auto sub = app.add_subcommand("kill", "Send a signal to a container");
-    sub->add_option("container-id", id_, "Unique identifier for the container")
+    sub->add_option("container-id",
+                    args_,
+                    "Unique identifiers for the containers, optionally "
+                    "followed by the signal to send, which defaults to TERM")
         ->required();
-    sub->add_option("signal", signame_, "Signal to send, defaults to TERM");
+    sub->add_option("--signal,-s",
+                    signame_,
+                    "Signal to send, treating every argument as a container "
+                    "id");
     auto all_opt = sub->add_flag(
         "--all,-a", all_, "Send the signal to all processes in the container");
     auto pid_opt = sub->add_option(
@@ -29,45 +35,84 @@ kill::kill(main_app& app) : app_(app) {
     sub->final_callback([this] { run(); });
 }
 
-void kill::run() {
+static std::optional<int> parse_signal(const std::string& signame) {
+    // This can be either the signal number or its name. Try the number
+    // first.
+    size_t len = 0;
     int signum = 0;
-    if (signame_) {
-        // This can be either the signal number or its name. Try the
-        // number first.
-        size_t len = 0;
-        try {
-            signum = std::stoi(*signame_, &len, 10);
-        } catch (...) {
-            // if we get an exception, try matching it as a signal
-            // name.
-            len = 0;
-        }
-        if (len != signame_->size()) {
-            for (int i = 0; i < sys_nsig; i++) {
-                if (sys_signame[i] && *signame_ == sys_signame[i]) {
-                    signum = i;
-                    break;
-                }
+    try {
+        signum = std::stoi(signame, &len, 10);
+    } catch (...) {
+        // if we get an exception, try matching it as a signal name.
+        len = 0;
+    }
+    if (len != signame.size()) {
+        for (int i = 0; i < sys_nsig; i++) {
+            if (sys_signame[i] && signame == sys_signame[i]) {
+                signum = i;
+                break;
             }
         }
-        if (signum == 0) {
+    }
+    if (signum <= 0 || signum >= sys_nsig) {
+        return std::nullopt;
+    }
+    return signum;
+}
+
+void kill::run() {
+    // Without --signal, the last argument is the signal if there is more
+    // than one and it names a signal, as in 'kill <container-id> <signal>'.
+    // Otherwise every argument is a container id.
+    std::vector<std::string> ids = args_;
+    int signum = SIGTERM;
+    if (signame_) {
+        auto sig = parse_signal(*signame_);
+        if (!sig) {
             throw std::runtime_error("Unknown signal name " + *signame_);
         }
-    } else {
-        signum = SIGTERM;
+        signum = *sig;
+    } else if (ids.size() > 1) {
+        if (auto sig = parse_signal(ids.back())) {
+            signum = *sig;
+            ids.pop_back();
+        }
+    }
+
+    if (ids.size() == 1) {
+        signal(ids[0], signum);
+        return;
+    }
+
+    // Signal every container, reporting failures without giving up on the
+    // rest.
+    size_t failed = 0;
+    for (auto& id : ids) {
+        try {
+            signal(id, signum);
+        } catch (const std::exception& e) {
+            app_.log_error(e);
+            failed++;
+        }
     }
+    if (failed) {
+        throw std::runtime_error("kill: failed to signal " +
+                                 std::to_string(failed) + " containers");
+    }
+}
 
-    auto state = app_.get_runtime_state(id_);
+void kill::signal(const std::string& id, int signum) {
+    auto state = app_.get_runtime_state(id);
     auto lk = state.lock();
     state.load();
 
-    if (state["status"] == "created" || state["status"] == "running") {
-        if (::kill(state["pid"], signum) < 0 && errno != ESRCH) {
+    if (state.status() == container_status::CREATED ||
+        state.status() == container_status::RUNNING) {
+        if (::kill(state.pid(), signum) < 0 && errno != ESRCH) {
             throw std::system_error(
                 errno,
                 std::system_category(),
-                "sending signal to pid " +
-                    std::to_string(state["pid"].get<int>()));
+                "sending signal to pid " + std::to_string(state.pid()));
         }
     }
 }
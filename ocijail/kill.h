@@ -1,6 +1,7 @@
 #pragma once
 
 #include <optional>
+#include <vector>
 
 #include "ocijail/main.h"
 
@@ -12,9 +13,11 @@ struct kill {
    private:
     kill(main_app& app);
     void run();
+    void signal(const std::string& id, int signum);
 
     main_app& app_;
-    std::string id_;
+    // The container ids, optionally followed by the signal
+    std::vector<std::string> args_;
     std::optional<std::string> signame_;
     std::optional<int> pid_;
     bool all_;
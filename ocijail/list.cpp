@@ -1,6 +1,10 @@
 #include <signal.h>
+#include <algorithm>
+#include <atomic>
 #include <charconv>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include "nlohmann/json.hpp"
 
@@ -23,59 +27,166 @@ list::list(main_app& app) : app_(app) {
     };
 
     auto sub = app.add_subcommand("list", "List containers");
-    sub->add_option("--quiet,-q", quiet_, "show only IDs");
+    sub->add_flag("--quiet,-q", quiet_, "show only IDs");
     sub->add_option("--format,-f",
                     format_,
                     "output format: either table or json (default: table)")
         ->transform(CLI::CheckedTransformer(formats, CLI::ignore_case));
+    sub->add_option("--jobs,-j",
+                    jobs_,
+                    "maximum number of containers to load concurrently")
+        ->check(CLI::PositiveNumber);
+    sub->add_option("--filter",
+                    filters_,
+                    "only list containers matching status=<status> or "
+                    "id-prefix=<prefix>");
     sub->final_callback([this] { run(); });
 }
 
 void list::run() {
-    std::map<std::string, runtime_state> states;
-    int max_id_width = 1;
+    std::optional<container_status> status_filter;
+    std::vector<std::string> prefixes;
+    for (auto& filter : filters_) {
+        auto i = filter.find('=');
+        auto key = filter.substr(0, i);
+        auto value = i == std::string::npos ? "" : filter.substr(i + 1);
+        if (key == "id-prefix") {
+            prefixes.push_back(value);
+        } else if (key == "status") {
+            for (auto status : {container_status::CREATING,
+                                container_status::CREATED,
+                                container_status::RUNNING,
+                                container_status::STOPPED}) {
+                if (status_name(status) == value) {
+                    status_filter = status;
+                }
+            }
+            if (!status_filter) {
+                throw std::runtime_error("list: unknown status " + value);
+            }
+        } else {
+            throw std::runtime_error("list: unknown filter " + filter);
+        }
+    }
 
+    // Only the ids are collected up front. Containers which don't match an
+    // id-prefix filter are never read at all.
+    std::vector<std::string> ids;
+    int max_id_width = 1;
     for (const auto& it : fs::directory_iterator{app_.get_state_db()}) {
+        // Skip anything which isn't a container, e.g. the serve socket
+        if (!it.is_directory()) {
+            continue;
+        }
         auto id = it.path().filename().native();
+        if (!prefixes.empty() &&
+            std::none_of(prefixes.begin(), prefixes.end(), [&](auto& p) {
+                return id.starts_with(p);
+            })) {
+            continue;
+        }
         if (id.size() > max_id_width) {
             max_id_width = id.size();
         }
-        auto state = app_.get_runtime_state(id);
-        if (state.exists()) {
-            auto lk = state.lock();
-            state.load();
-            state.check_status();
-            if (state["status"] == "stopped") {
-                state["pid"] = 0;
-            }
-            states.emplace(id, state);
-        }
+        ids.push_back(id);
     }
+    std::sort(ids.begin(), ids.end());
 
-    if (format_ == list_format::LIST_TABLE) {
+    if (format_ == list_format::LIST_TABLE && !quiet_) {
         std::cout << std::left << std::setw(max_id_width) << "ID"
                   << " " << std::setw(10) << "PID"
                   << " " << std::setw(8) << "STATUS"
                   << " " << std::setw(40) << "BUNDLE"
                   << "\n";
-        for (const auto& [id, state] : states) {
+    } else if (format_ == list_format::LIST_JSON) {
+        std::cout << "[";
+    }
+    bool first = true;
+    auto print = [&](const std::string& id, const row& r) {
+        if (format_ == list_format::LIST_TABLE) {
+            if (quiet_) {
+                std::cout << id << "\n";
+                return;
+            }
             std::cout << std::left << std::setw(max_id_width) << id << " "
-                      << std::setw(10) << state["pid"].get<int>() << " "
-                      << std::setw(8) << state["status"].get<std::string>()
-                      << " " << std::setw(40)
-                      << state["bundle"].get<std::string>() << "\n";
-        }
-    } else {
-        json res;
-        for (const auto& [id, state] : states) {
+                      << std::setw(10) << r.pid << " " << std::setw(8)
+                      << status_name(r.status) << " " << std::setw(40)
+                      << r.bundle.native() << "\n";
+        } else {
             json entry;
             entry["id"] = id;
-            entry["pid"] = state["pid"];
-            entry["status"] = state["status"];
-            entry["bundle"] = state["bundle"];
-            res.push_back(entry);
+            entry["pid"] = r.pid;
+            entry["status"] = status_name(r.status);
+            entry["bundle"] = r.bundle;
+            std::cout << (first ? "" : ",") << entry;
         }
-        std::cout << res;
+        first = false;
+    };
+
+    // Load the states in batches on a small pool of threads, keeping only
+    // the columns we print and writing each batch out before loading the
+    // next. Loading a snapshot doesn't wait for the state lock and if a
+    // container's lock is busy, check_status reports it from the snapshot
+    // rather than waiting. A container which is deleted while we read it is
+    // left out, as is one whose state can't be read, which is logged.
+    size_t batch_size = 16 * jobs_;
+    std::vector<std::optional<row>> rows;
+    for (size_t start = 0; start < ids.size(); start += batch_size) {
+        auto end = std::min(start + batch_size, ids.size());
+        rows.assign(end - start, std::nullopt);
+        std::atomic<size_t> next{start};
+        auto worker = [&] {
+            for (;;) {
+                auto i = next++;
+                if (i >= end) {
+                    break;
+                }
+                auto state = app_.get_runtime_state(ids[i]);
+                try {
+                    if (!state.exists()) {
+                        continue;
+                    }
+                    state.load_snapshot();
+                    state.check_status();
+                    if (status_filter && state.status() != *status_filter) {
+                        continue;
+                    }
+                    auto stopped = state.status() == container_status::STOPPED;
+                    rows[i - start] = row{stopped ? 0 : state.pid(),
+                                          state.status(),
+                                          state.bundle()};
+                } catch (const std::exception& e) {
+                    if (state.exists()) {
+                        OCIJAIL_LOG_WARN(app_)
+                                .field("id", ids[i])
+                                .field("error", e.what())
+                            << "list: skipping container";
+                    }
+                }
+            }
+        };
+        auto nthreads = std::min<size_t>(jobs_, end - start);
+        if (nthreads <= 1) {
+            worker();
+        } else {
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < nthreads; i++) {
+                threads.emplace_back(worker);
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+        for (size_t i = start; i < end; i++) {
+            if (rows[i - start]) {
+                print(ids[i], *rows[i - start]);
+            }
+        }
+        std::cout.flush();
+    }
+
+    if (format_ == list_format::LIST_JSON) {
+        std::cout << "]";
     }
 }
 
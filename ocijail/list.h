@@ -1,6 +1,7 @@
 #pragma once
 
 #include <optional>
+#include <vector>
 
 #include "ocijail/main.h"
 
@@ -15,12 +16,21 @@ struct list {
     static void init(main_app& app);
 
    private:
+    // The columns printed for each container
+    struct row {
+        int pid;
+        container_status status;
+        std::filesystem::path bundle;
+    };
+
     list(main_app& app);
     void run();
 
     main_app& app_;
     bool quiet_{false};
     list_format format_{LIST_TABLE};
+    int jobs_{8};
+    std::vector<std::string> filters_;
 };
 
 }  // namespace ocijail
@@ -1,19 +1,26 @@
 #include <fcntl.h>
+#include <sched.h>
 #include <signal.h>
-#include <sys/time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
 #include <ctime>
-#include <iomanip>
+#include <utility>
 
 #include "ocijail/create.h"
 #include "ocijail/delete.h"
+#include "ocijail/events.h"
 #include "ocijail/exec.h"
 #include "ocijail/features.h"
 #include "ocijail/kill.h"
 #include "ocijail/list.h"
 #include "ocijail/main.h"
+#include "ocijail/metrics.h"
+#include "ocijail/serve.h"
 #include "ocijail/start.h"
 #include "ocijail/state.h"
+#include "ocijail/wait.h"
 
 using namespace ocijail;
 using nlohmann::json;
@@ -21,6 +28,16 @@ using nlohmann::json;
 static const char* version = "0.5.0-dev";
 
 int main(int argc, char** argv) {
+    // If a daemon is running, let it execute the command for us.
+    try {
+        if (auto status = serve::forward(argc, argv)) {
+            return *status;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
     main_app app{"ocijail: Yet another OCI runtime"};
 
     create::init(app);
@@ -31,17 +48,12 @@ int main(int argc, char** argv) {
     state::init(app);
     list::init(app);
     features::init(app);
+    serve::init(app);
+    events::init(app);
+    wait_::init(app);
+    metrics::init(app);
 
-    try {
-        app.parse(argc, argv);
-    } catch (const CLI::ParseError& e) {
-        return app.exit(e);
-    } catch (const std::exception& e) {
-        app.log_error(e);
-        return 1;
-    }
-
-    return 0;
+    return app.run(argc, argv);
 }
 
 namespace ocijail {
@@ -91,34 +103,281 @@ void runtime_state::remove_all() {
     std::filesystem::remove_all(state_dir_);
 }
 
+static void copy_path(char (&dst)[MAXPATHLEN],
+                      const std::filesystem::path& path) {
+    if (path.native().size() >= MAXPATHLEN) {
+        throw std::system_error(
+            ENAMETOOLONG, std::system_category(), path.native());
+    }
+    std::fill_n(dst, MAXPATHLEN, 0);
+    std::copy(path.native().begin(), path.native().end(), dst);
+}
+
+void runtime_state::set_bundle(const std::filesystem::path& path) {
+    copy_path(record_.bundle, path);
+}
+
+void runtime_state::set_root_path(const std::filesystem::path& path) {
+    copy_path(record_.root_path, path);
+}
+
+int runtime_state::open_record(int flags) const {
+    auto fd = ::open(state_record_.c_str(), flags | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            std::stringstream ss;
+            ss << "container " << id_ << " not found";
+            throw std::runtime_error(ss.str());
+        }
+        throw std::system_error(
+            errno, std::system_category(), "opening container state");
+    }
+    return fd;
+}
+
+void runtime_state::read_record(int fd) {
+    auto n = ::pread(fd, &record_, sizeof(record_), 0);
+    if (n < 0) {
+        throw std::system_error(
+            errno, std::system_category(), "reading container state");
+    }
+    if (n != sizeof(record_) || record_.magic != record::MAGIC ||
+        record_.version != record::VERSION) {
+        throw std::runtime_error("container " + std::string{id_} +
+                                 " has corrupt state");
+    }
+}
+
+void runtime_state::write_record(int fd, size_t offset, size_t len) {
+    auto p = reinterpret_cast<const char*>(&record_) + offset;
+    if (::pwrite(fd, p, len, offset) < 0) {
+        throw std::system_error(
+            errno, std::system_category(), "writing container state");
+    }
+}
+
+bool runtime_state::migrate_legacy() {
+    if (!std::filesystem::is_regular_file(state_json_)) {
+        return false;
+    }
+    json legacy;
+    std::ifstream{state_json_} >> legacy;
+    if (!legacy.is_object() || !legacy.contains("status")) {
+        return false;
+    }
+    record_ = record{};
+    auto status = legacy["status"].get<std::string>();
+    for (auto s : {container_status::CREATING,
+                   container_status::CREATED,
+                   container_status::RUNNING,
+                   container_status::STOPPED}) {
+        if (status == status_name(s)) {
+            record_.status = s;
+        }
+    }
+    record_.pid = legacy.value("pid", -1);
+    record_.jid = legacy.value("jid", -1);
+    set_bundle(legacy.value("bundle", ""));
+    set_root_path(legacy.value("root_path", ""));
+    if (legacy.contains("config")) {
+        replace_file(config_json_, legacy["config"].dump());
+    }
+    // The other fields are still read from state.json
+    replace_record();
+    return true;
+}
+
 void runtime_state::load() {
-    if (!std::filesystem::is_directory(state_dir_)) {
-        std::stringstream ss;
-        ss << "container " << id_ << " not found";
-        throw std::runtime_error(ss.str());
+    if (!std::filesystem::exists(state_record_)) {
+        migrate_legacy();
+    }
+    auto fd = open_record(O_RDONLY);
+    try {
+        read_record(fd);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+
+    // Defer reading state.json and config.json until they are needed
+    snapshot_ = false;
+    state_pending_ = true;
+    config_.reset();
+}
+
+// How many times load_snapshot reads the record before taking the lock
+static constexpr int snapshot_attempts = 1000;
+
+void runtime_state::load_snapshot() {
+    if (!std::filesystem::exists(state_record_)) {
+        migrate_legacy();
+    }
+    auto fd = open_record(O_RDONLY);
+    try {
+        // Writers replace the record with rename so our descriptor always
+        // refers to a complete record, except for in-place status updates
+        // which bracket the change with generation updates.
+        //
+        // A writer which dies during an update leaves the generation odd
+        // until the next writer repairs it, so after a few attempts we wait
+        // for the state lock instead. Writers hold the lock so the record
+        // can't change while we have it.
+        bool consistent = false;
+        for (int attempt = 0; attempt < snapshot_attempts; attempt++) {
+            read_record(fd);
+            uint64_t generation;
+            if (::pread(fd,
+                        &generation,
+                        sizeof(generation),
+                        offsetof(record, generation)) < 0) {
+                throw std::system_error(
+                    errno, std::system_category(), "reading container state");
+            }
+            if (generation == record_.generation && (generation & 1) == 0) {
+                consistent = true;
+                break;
+            }
+            ::sched_yield();
+        }
+        if (!consistent) {
+            // Open the record again since it may have been replaced
+            auto lk = lock();
+            ::close(std::exchange(fd, -1));
+            fd = open_record(O_RDONLY);
+            read_record(fd);
+        }
+    } catch (...) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        throw;
     }
-    std::ifstream{state_json_} >> state_;
+    ::close(fd);
+
+    snapshot_ = true;
+    state_pending_ = true;
+    config_.reset();
+}
+
+void runtime_state::replace_file(const std::filesystem::path& path,
+                                 std::string_view contents) {
+    auto tmp = path;
+    tmp += ".tmp";
+    std::ofstream{tmp} << contents;
+    std::filesystem::rename(tmp, path);
 }
 
 void runtime_state::save() {
-    std::ofstream{state_json_} << state_;
+    // Publish the less frequently used files first so that a reader which
+    // sees the new record also sees them.
+    replace_file(state_json_, state_.dump());
+    if (config_text_) {
+        replace_file(config_json_, *config_text_);
+        config_text_.reset();
+    }
+    replace_record();
+}
+
+void runtime_state::replace_record() {
+    // The name is private to this process since legacy states may be
+    // migrated by several readers at once
+    auto tmp = state_record_;
+    tmp += "." + std::to_string(::getpid());
+    auto fd = ::open(
+        tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        throw std::system_error(
+            errno, std::system_category(), "creating container state");
+    }
+    // Make the generation even, in case an earlier update was interrupted,
+    // and different from any which readers may have seen.
+    record_.generation = (record_.generation | 1) + 1;
+    try {
+        write_record(fd, 0, sizeof(record_));
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    std::filesystem::rename(tmp, state_record_);
+}
+
+void runtime_state::update_record(size_t offset, size_t len) {
+    auto fd = open_record(O_WRONLY);
+    try {
+        // The generation is already odd if an earlier update was
+        // interrupted, in which case it is left odd until this one is done.
+        record_.generation |= 1;
+        write_record(fd, offsetof(record, generation), sizeof(uint64_t));
+        write_record(fd, offset, len);
+        record_.generation++;
+        write_record(fd, offsetof(record, generation), sizeof(uint64_t));
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+void runtime_state::update_status(container_status status) {
+    record_.status = status;
+    update_record(offsetof(record, status), sizeof(record_.status));
+}
+
+void runtime_state::update_exit(int exit_status, const ::timespec& exit_time) {
+    record_.status = container_status::STOPPED;
+    record_.exit_status = exit_status;
+    record_.exit_time_sec = exit_time.tv_sec;
+    record_.exit_time_nsec = exit_time.tv_nsec;
+    update_record(offsetof(record, status),
+                  offsetof(record, bundle) - offsetof(record, status));
+}
+
+void runtime_state::update_monitor_pid(pid_t pid) {
+    record_.monitor_pid = pid;
+    update_record(offsetof(record, monitor_pid), sizeof(record_.monitor_pid));
+}
+
+nlohmann::json& runtime_state::cold() {
+    if (state_pending_) {
+        state_pending_ = false;
+        if (std::filesystem::is_regular_file(state_json_)) {
+            std::ifstream{state_json_} >> state_;
+        }
+    }
+    return state_;
+}
+
+const oci_config& runtime_state::config() const {
+    if (!config_) {
+        if (std::filesystem::is_regular_file(config_json_)) {
+            mapped_file config_file{config_json_};
+            config_ = oci_config::parse(config_file.contents());
+        } else {
+            config_ = oci_config{};
+        }
+    }
+    return *config_;
+}
+
+void runtime_state::set_config(std::string text, oci_config config) {
+    config_text_ = std::move(text);
+    config_ = std::move(config);
 }
 
 json runtime_state::report() const {
     json res;
     res["ociVersion"] = "1.0.2";
     res["id"] = id_;
-    res["status"] = state_["status"];
-    if (state_["status"] != "stopped") {
-        if (state_.contains("pid")) {
-            res["pid"] = state_["pid"];
-        } else {
-            res["pid"] = -1;
-        }
+    res["status"] = status_name(status());
+    if (status() != container_status::STOPPED) {
+        res["pid"] = pid();
     }
-    res["bundle"] = state_["bundle"];
-    if (state_["config"].contains("annotations")) {
-        res["annotations"] = state_["config"]["annotations"];
+    res["bundle"] = bundle();
+    auto& config = this->config();
+    if (!config.annotations.empty()) {
+        res["annotations"] = config.annotations;
     }
     return res;
 }
@@ -136,13 +395,73 @@ runtime_state::locked_state runtime_state::lock() {
     return {true, fd};
 }
 
+std::optional<runtime_state::locked_state> runtime_state::try_lock() {
+    auto fd = ::open(state_lock_.c_str(), O_RDWR | O_CREAT);
+    if (fd < 0) {
+        throw std::system_error(
+            errno, std::system_category(), "opening state lock");
+    }
+    if (::flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) {
+            ::close(fd);
+            return std::nullopt;
+        }
+        throw std::system_error(
+            errno, std::system_category(), "locking state lock");
+    }
+    return locked_state{true, fd};
+}
+
+static bool process_exited(container_status status, int pid) {
+    return (status == container_status::CREATED ||
+            status == container_status::RUNNING) &&
+           ::kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+// Whether the monitor of a container has gone without recording the exit of
+// the container process, e.g. because it was killed
+static bool monitor_gone(int monitor_pid) {
+    return monitor_pid <= 0 || (::kill(monitor_pid, 0) < 0 && errno == ESRCH);
+}
+
 void runtime_state::check_status() {
-    if (state_["status"] == "created" || state_["status"] == "running") {
-        if (::kill(state_["pid"], 0) < 0 && errno == ESRCH) {
-            state_["status"] = "stopped";
-            save();
+    // A monitored container's status is updated by its monitor when the
+    // process exits so there is nothing to check unless the monitor has
+    // gone, in which case we fall back to checking the process.
+    if (monitored() && !monitor_gone(monitor_pid())) {
+        return;
+    }
+    if (!process_exited(status(), pid())) {
+        return;
+    }
+    if (snapshot_) {
+        // We don't hold the lock. Record the change if nobody else is
+        // modifying the state, otherwise just report it.
+        auto lk = try_lock();
+        if (!lk) {
+            record_.status = container_status::STOPPED;
+            return;
+        }
+        load();
+        if (!process_exited(status(), pid())) {
+            return;
         }
     }
+    update_status(container_status::STOPPED);
+}
+
+std::string_view status_name(container_status status) {
+    switch (status) {
+    case container_status::CREATING:
+        return "creating";
+    case container_status::CREATED:
+        return "created";
+    case container_status::RUNNING:
+        return "running";
+    case container_status::STOPPED:
+        return "stopped";
+    }
+    return "unknown";
 }
 
 main_app::main_app(const std::string& title) : CLI::App(title) {
@@ -171,13 +490,21 @@ main_app::main_app(const std::string& title) : CLI::App(title) {
     add_option("--log-format", log_format_, "Log format")
         ->transform(CLI::CheckedTransformer(log_formats, CLI::ignore_case));
     std::map<std::string, log_level> log_levels{
-        {"info", log_level::INFO},
+        {"error", log_level::ERROR},
         {"warn", log_level::WARN},
+        {"info", log_level::INFO},
         {"debug", log_level::DEBUG},
     };
     add_option("--log-level", log_level_, "Log level")
         ->transform(CLI::CheckedTransformer(log_levels, CLI::ignore_case));
     add_option("--log", log_file_, "Log file");
+    add_option("--trace-file",
+               trace_file_,
+               "Append timing spans in Chrome trace-event format to a file");
+    add_option("--copyup-cache-size",
+               copyup_cache_size_,
+               "Bytes of tmpcopyup archives to keep in the state database "
+               "(default 256MiB, 0 disables)");
 
     require_subcommand(1);
 
@@ -186,49 +513,223 @@ main_app::main_app(const std::string& title) : CLI::App(title) {
             log_fd_ =
                 ::open(log_file_->c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
         }
+        if (trace_file_) {
+            tracer_.open(*trace_file_);
+        }
     });
 }
 
-static std::string log_timestamp() {
-    struct ::timeval tv;
-    struct std::tm now;
-    gettimeofday(&tv, nullptr);
-    gmtime_r(&tv.tv_sec, &now);
-    std::stringstream ss;
-    ss << std::put_time(&now, "%Y-%m-%dT%H:%M:%S");
-    ss << std::setw(9) << std::setfill('0') << tv.tv_usec << "Z";
-    return ss.str();
+template <typename F>
+static int run_guarded(main_app& app, F&& parse) {
+    int status = 0;
+    try {
+        parse();
+    } catch (const CLI::ParseError& e) {
+        return app.exit(e);
+    } catch (const std::exception& e) {
+        app.log_error(e);
+        status = 1;
+    }
+    app.finish(status);
+    return status;
+}
+
+int main_app::run(int argc, char** argv) {
+    pid_ = ::getpid();
+    start_time_ = tracer::now();
+    finished_ = false;
+    return run_guarded(*this, [&] { parse(argc, argv); });
+}
+
+int main_app::run(std::vector<std::string> args) {
+    reset_options();
+    pid_ = ::getpid();
+    start_time_ = tracer::now();
+    finished_ = false;
+    counters_ = {};
+    // CLI11 expects the arguments in reverse order
+    std::reverse(args.begin(), args.end());
+    return run_guarded(*this, [&] { parse(args); });
+}
+
+void main_app::reset_options() {
+    state_db_ = default_state_db;
+    test_mode_ = test_mode::NONE;
+    copyup_cache_size_ = default_copyup_cache_size;
+    log_format_ = log_format::TEXT;
+    log_level_ = log_level::INFO;
+    log_file_.reset();
+    if (log_fd_ != 2) {
+        if (log_fd_ >= 0) {
+            ::close(log_fd_);
+        }
+        log_fd_ = 2;
+    }
+    log_time_sec_ = -1;
+    trace_file_.reset();
+    tracer_.close();
+}
+
+void main_app::finish(int status) {
+    // Only record the process which called run, not forked children which
+    // return through it after a failure.
+    if (finished_ || ::getpid() != pid_ || test_mode_ != test_mode::NONE) {
+        return;
+    }
+    finished_ = true;
+    auto subcommands = get_subcommands();
+    if (subcommands.empty() || !std::filesystem::is_directory(state_db_)) {
+        return;
+    }
+    // Failing to record metrics should not affect the command
+    try {
+        metrics_file metrics{state_db_};
+        metrics.record(subcommands[0]->get_name(),
+                       status == 0,
+                       tracer::now() - start_time_);
+        for (size_t i = 0; i < counters_.size(); i++) {
+            if (counters_[i]) {
+                metrics.add(metric_counter(i), counters_[i]);
+            }
+        }
+    } catch (const std::exception& e) {
+        OCIJAIL_LOG_DEBUG(*this).field("error", e.what())
+            << "recording metrics failed";
+    }
+}
+
+static std::string_view level_name(log_level level) {
+    switch (level) {
+    case log_level::ERROR:
+        return "error";
+    case log_level::WARN:
+        return "warn";
+    case log_level::INFO:
+        return "info";
+    case log_level::DEBUG:
+        return "debug";
+    }
+    return "unknown";
+}
+
+// Fields may hold paths or arguments from the config which aren't valid
+// UTF-8. This runs from the log_entry destructor so it must not throw.
+static std::string dump_field(const json& value) {
+    return value.dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+static void append_json_string(std::string& buf, std::string_view s) {
+    static const char hex[] = "0123456789abcdef";
+    buf += '"';
+    for (unsigned char ch : s) {
+        switch (ch) {
+        case '"':
+            buf += "\\\"";
+            break;
+        case '\\':
+            buf += "\\\\";
+            break;
+        case '\n':
+            buf += "\\n";
+            break;
+        case '\r':
+            buf += "\\r";
+            break;
+        case '\t':
+            buf += "\\t";
+            break;
+        default:
+            if (ch < 0x20) {
+                buf += "\\u00";
+                buf += hex[ch >> 4];
+                buf += hex[ch & 15];
+            } else {
+                buf += ch;
+            }
+        }
+    }
+    buf += '"';
 }
 
 log_entry::~log_entry() {
-    if (level_ <= app_.get_log_level()) {
-        app_.log_message(ss_.str());
+    if (app_.log_enabled(level_)) {
+        app_.log_message(level_, ss_.str(), fields_);
     }
 }
 
+void main_app::log_error(const std::system_error& e) {
+    log_message(log_level::ERROR, e.what(), {{"errno", e.code().value()}});
+}
+
 void main_app::log_error(const std::exception& e) {
-    log_message(e.what());
+    log_message(log_level::ERROR, e.what());
 }
 
-void main_app::log_message(const std::string& msg) {
-    std::stringstream ss;
+void main_app::log_message(log_level level,
+                           std::string_view msg,
+                           const json& fields) {
+    std::lock_guard lk{log_mutex_};
+
+    // Formatting the date is relatively expensive so only do it when the
+    // second changes.
+    ::timespec now;
+    ::clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != log_time_sec_) {
+        struct std::tm tm;
+        char prefix[32];
+        gmtime_r(&now.tv_sec, &tm);
+        std::strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+        log_time_sec_ = now.tv_sec;
+        log_time_prefix_ = prefix;
+    }
+    char fraction[16];
+    std::snprintf(fraction, sizeof(fraction), ".%09ldZ", long(now.tv_nsec));
+
+    log_buf_.clear();
     switch (log_format_) {
     case log_format::TEXT:
-        ss << log_timestamp() << ": " << msg << "\n";
+        log_buf_ += log_time_prefix_;
+        log_buf_ += fraction;
+        log_buf_ += ' ';
+        log_buf_ += level_name(level);
+        log_buf_ += ": ";
+        log_buf_ += msg;
+        if (fields.is_object()) {
+            for (auto& [key, value] : fields.items()) {
+                log_buf_ += ' ';
+                log_buf_ += key;
+                log_buf_ += '=';
+                if (value.is_string()) {
+                    log_buf_ += value.get_ref<const std::string&>();
+                } else {
+                    log_buf_ += dump_field(value);
+                }
+            }
+        }
         break;
-    case log_format::JSON: {
-        json err;
-        err["msg"] = msg;
-        err["level"] = "error";
-        err["time"] = log_timestamp();
-        ss << err << "\n";
+    case log_format::JSON:
+        log_buf_ += "{\"level\":\"";
+        log_buf_ += level_name(level);
+        log_buf_ += "\",\"time\":\"";
+        log_buf_ += log_time_prefix_;
+        log_buf_ += fraction;
+        log_buf_ += "\",\"msg\":";
+        append_json_string(log_buf_, msg);
+        if (fields.is_object()) {
+            for (auto& [key, value] : fields.items()) {
+                log_buf_ += ',';
+                append_json_string(log_buf_, key);
+                log_buf_ += ':';
+                log_buf_ += dump_field(value);
+            }
+        }
+        log_buf_ += '}';
         break;
     }
-    }
-    auto s = ss.str();
-    ::write(log_fd_, s.data(), s.size());
+    log_buf_ += '\n';
+    ::write(log_fd_, log_buf_.data(), log_buf_.size());
 
-    if (log_fd_ != 2) {
+    if (level == log_level::ERROR && log_fd_ != 2) {
         // Copy to stderr
         std::cerr << "Error: " << msg << "\n";
     }
@@ -1,13 +1,43 @@
 #pragma once
 
+#include <sys/param.h>
+
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <optional>
 #include <sstream>
 
 #include "CLI/CLI.hpp"
 #include "nlohmann/json.hpp"
 
+#include "ocijail/config.h"
+#include "ocijail/metrics.h"
+#include "ocijail/trace.h"
+
+// The most verbose log level which is compiled in. Release builds set this to
+// WARN so that info and debug statements are removed entirely.
+#ifndef OCIJAIL_LOG_LEVEL
+#define OCIJAIL_LOG_LEVEL DEBUG
+#endif
+
+// Log a message if its level is enabled, e.g.
+//
+//     OCIJAIL_LOG_DEBUG(app) << "resolving " << path;
+//
+// The level is checked before anything is evaluated or formatted so disabled
+// statements cost a comparison, or nothing at all if the level is not
+// compiled in.
+#define OCIJAIL_LOG(app, level)      \
+    if (!(app).log_enabled(level)) { \
+    } else                           \
+        (app).log(level)
+#define OCIJAIL_LOG_INFO(app) OCIJAIL_LOG(app, ::ocijail::log_level::INFO)
+#define OCIJAIL_LOG_WARN(app) OCIJAIL_LOG(app, ::ocijail::log_level::WARN)
+#define OCIJAIL_LOG_DEBUG(app) OCIJAIL_LOG(app, ::ocijail::log_level::DEBUG)
+
 namespace ocijail {
 
 enum class log_format {
@@ -15,19 +45,38 @@ enum class log_format {
     JSON,
 };
 
+// Ordered by severity so that enabling a level enables everything more
+// severe
 enum class log_level {
-    INFO,
+    ERROR,
     WARN,
+    INFO,
     DEBUG,
 };
 
+constexpr log_level compiled_log_level = log_level::OCIJAIL_LOG_LEVEL;
+
 enum class test_mode {
     NONE,        // not testing
     VALIDATION,  // test config validation
 };
 
+enum class container_status : int32_t {
+    CREATING,
+    CREATED,
+    RUNNING,
+    STOPPED,
+};
+
+std::string_view status_name(container_status status);
+
 class runtime_state {
     struct locked_state {
+        locked_state(bool locked, int fd) : locked_(locked), fd_(fd) {}
+        locked_state(locked_state&& other)
+            : locked_(other.locked_), fd_(other.fd_) {
+            other.locked_ = false;
+        }
         ~locked_state();
         void unlock();
         void lock();
@@ -35,37 +84,136 @@ class runtime_state {
         int fd_;
     };
 
+    // The fields which change during the container lifecycle or which are
+    // needed by every command are kept in a fixed-layout record which can be
+    // read and updated in place. Everything else (mount bookkeeping) lives in
+    // state.json and the bundle config is stored separately in config.json.
+    //
+    // The generation is used as a sequence lock: it is odd while an in-place
+    // update is in progress and changes whenever the record is written. This
+    // allows readers to take a consistent snapshot without the state lock.
+    // If a writer dies mid-update, the next writer makes it even again.
+    struct record {
+        static constexpr uint32_t MAGIC = 0x6f63696a;  // "ocij"
+        static constexpr uint32_t VERSION = 3;
+
+        // The container process is watched by a monitor process which
+        // records its exit in exit_status and exit_time.
+        static constexpr uint32_t MONITORED = 1;
+
+        uint32_t magic{MAGIC};
+        uint32_t version{VERSION};
+        uint64_t generation{0};
+        container_status status{container_status::CREATING};
+        int32_t pid{-1};
+        int32_t jid{-1};
+        uint32_t flags{0};
+        int32_t exit_status{-1};
+        // The pid of the monitor, or 0 if it is not known
+        int32_t monitor_pid{0};
+        int64_t exit_time_sec{0};
+        int64_t exit_time_nsec{0};
+        char bundle[MAXPATHLEN]{};
+        char root_path[MAXPATHLEN]{};
+    };
+
    public:
     runtime_state(const std::filesystem::path& dir, std::string_view id)
         : id_(id),
           state_dir_(dir),
+          state_record_(dir / "status"),
           state_json_(dir / "state.json"),
+          config_json_(dir / "config.json"),
           state_lock_(dir / "state.lock") {}
 
-    bool contains(auto&& key) { return state_.contains(key); }
-    auto& operator[](auto&& key) { return state_[key]; }
-    const auto& operator[](auto&& key) const { return state_[key]; }
+    // Access to the less frequently used fields in state.json which is only
+    // read on first use.
+    bool contains(auto&& key) { return cold().contains(key); }
+    auto& operator[](auto&& key) { return cold()[key]; }
+
     auto get_id() const { return id_; }
+    // Containers created by versions without the status record only have
+    // state.json, which load converts
     auto exists() const {
-        return std::filesystem::is_regular_file(state_json_);
+        return std::filesystem::is_regular_file(state_record_) ||
+               std::filesystem::is_regular_file(state_json_);
     }
     auto& get_state_dir() const { return state_dir_; }
     void check_status();
 
+    auto status() const { return record_.status; }
+    auto pid() const { return record_.pid; }
+    auto jid() const { return record_.jid; }
+    std::filesystem::path bundle() const { return record_.bundle; }
+    std::filesystem::path root_path() const { return record_.root_path; }
+    void set_status(container_status status) { record_.status = status; }
+    void set_pid(int pid) { record_.pid = pid; }
+    void set_jid(int jid) { record_.jid = jid; }
+    void set_bundle(const std::filesystem::path& path);
+    void set_root_path(const std::filesystem::path& path);
+    bool monitored() const { return record_.flags & record::MONITORED; }
+    void set_monitored() { record_.flags |= record::MONITORED; }
+    auto monitor_pid() const { return record_.monitor_pid; }
+
+    // The wait status recorded by the monitor, or -1 if it is not known
+    auto exit_status() const { return record_.exit_status; }
+    ::timespec exit_time() const {
+        return {record_.exit_time_sec, record_.exit_time_nsec};
+    }
+
+    // Change the container status, writing just that field of the record.
+    void update_status(container_status status);
+
+    // Mark the container stopped and record its exit status and time
+    void update_exit(int exit_status, const ::timespec& exit_time);
+
+    // Record the pid of the container's monitor, writing just that field
+    void update_monitor_pid(pid_t pid);
+
+    // The bundle config is loaded from config.json on first use.
+    const oci_config& config() const;
+    // Set the parsed config along with the text it was parsed from, which
+    // is written to config.json when the state is saved.
+    void set_config(std::string text, oci_config config);
+
     locked_state create();
     void remove_all();
     void load();
+    // Load a consistent copy of the status record without holding the state
+    // lock. This is used by commands which only read the state.
+    void load_snapshot();
     void save();
     nlohmann::json report() const;
     locked_state lock();
+    // Like lock but return std::nullopt if the lock is held elsewhere
+    std::optional<locked_state> try_lock();
 
    private:
+    nlohmann::json& cold();
+    int open_record(int flags) const;
+    void read_record(int fd);
+    void write_record(int fd, size_t offset, size_t len);
+    void update_record(size_t offset, size_t len);
+    // Write the whole record to a new file and rename it into place
+    void replace_record();
+    // Create the status record and config.json from a state.json written by
+    // a version without them. Returns false if there is no such state.
+    bool migrate_legacy();
+    void replace_file(const std::filesystem::path& path,
+                      std::string_view contents);
+
     std::string_view id_;
-    nlohmann::json state_;
+    record record_;
+    bool snapshot_{false};
+    nlohmann::json state_ = nlohmann::json::object();
+    bool state_pending_{false};
+    mutable std::optional<oci_config> config_;
+    std::optional<std::string> config_text_;
     std::filesystem::path state_dir_;
+    std::filesystem::path state_record_;
     std::filesystem::path state_json_;
+    std::filesystem::path config_json_;
     std::filesystem::path state_lock_;
-    // int lock_fd_{-1};
 };
 
 class main_app;
@@ -74,8 +222,15 @@ struct log_entry {
     log_entry(main_app& app, log_level level) : app_(app), level_(level) {}
     ~log_entry();
 
+    // Attach a key/value field to the record, e.g. a container id or errno
     template <typename T>
-    friend std::ostream& operator<<(const log_entry& log, T t) {
+    const log_entry& field(std::string_view key, const T& value) const {
+        fields_[std::string{key}] = value;
+        return *this;
+    }
+
+    template <typename T>
+    friend std::ostream& operator<<(const log_entry& log, const T& t) {
         return log.ss_ << t;
     }
 
@@ -83,30 +238,87 @@ struct log_entry {
     log_level level_;
 
     mutable std::stringstream ss_;
+    mutable nlohmann::json fields_;
 };
 
 class main_app : public CLI::App {
    public:
+    static constexpr std::string_view default_state_db = "/var/run/ocijail";
+    static constexpr uint64_t default_copyup_cache_size = uint64_t(256) << 20;
+
     main_app(const std::string& title);
+
+    // Parse and execute a command line, returning the exit status. The
+    // vector form takes the arguments without the program name.
+    int run(int argc, char** argv);
+    int run(std::vector<std::string> args);
+
     runtime_state get_runtime_state(std::string_view id) {
         return {state_db_ / id, id};
     }
     auto get_state_db() const { return state_db_; }
     auto get_test_mode() const { return test_mode_; }
+    auto get_copyup_cache_size() const { return copyup_cache_size_; }
     auto get_log_level() const { return log_level_; }
-    log_entry log() { return log_entry{*this, log_level::INFO}; }
-    log_entry log_debug() { return log_entry{*this, log_level::DEBUG}; }
+    // True if messages at the given level are compiled in and enabled
+    bool log_enabled(log_level level) const {
+        return level <= compiled_log_level && level <= log_level_;
+    }
+    // Prefer the OCIJAIL_LOG macros which skip formatting disabled messages
+    log_entry log(log_level level = log_level::INFO) {
+        return log_entry{*this, level};
+    }
     void log_error(const std::system_error& e);
     void log_error(const std::exception& e);
-    void log_message(const std::string& msg);
+    // Write a record to the log with a single write, formatted according
+    // to the log format. Errors are also copied to stderr if logging to a
+    // file.
+    void log_message(log_level level,
+                     std::string_view msg,
+                     const nlohmann::json& fields = nullptr);
+
+    // Add to one of the counters which are recorded in the metrics file.
+    // This may be called from worker threads.
+    void count(metric_counter counter, uint64_t value = 1) {
+        std::atomic_ref{counters_[size_t(counter)]}.fetch_add(
+            value, std::memory_order_relaxed);
+    }
+
+    // Record the outcome and duration of this invocation in the metrics
+    // file. This is called when run returns but commands which exit early
+    // must call it themselves.
+    void finish(int status);
+
+    // Start a span which is written to the trace file, if any, when it ends
+    trace_span trace(std::string name, nlohmann::json args = nullptr) {
+        return {tracer_, std::move(name), std::move(args)};
+    }
 
    private:
-    std::filesystem::path state_db_{"/var/run/ocijail"};
+    // Set the global options back to their defaults before parsing another
+    // command line, since CLI11 only assigns the options which are given
+    void reset_options();
+
+    std::filesystem::path state_db_{default_state_db};
     test_mode test_mode_{test_mode::NONE};
+    uint64_t copyup_cache_size_{default_copyup_cache_size};
     log_format log_format_{log_format::TEXT};
     log_level log_level_{log_level::INFO};
     std::optional<std::filesystem::path> log_file_;
     int log_fd_{2};
+    // Reused for formatting each record, along with the formatted date and
+    // time of the most recent record to the nearest second. These are
+    // guarded by log_mutex_ since some commands log from worker threads.
+    std::mutex log_mutex_;
+    std::string log_buf_;
+    time_t log_time_sec_{-1};
+    std::string log_time_prefix_;
+    std::optional<std::filesystem::path> trace_file_;
+    tracer tracer_;
+    pid_t pid_{-1};
+    int64_t start_time_{0};
+    bool finished_{false};
+    std::array<uint64_t, size_t(metric_counter::COUNT_)> counters_{};
 };
 
 void malformed_config(std::string_view message);
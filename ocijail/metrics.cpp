@@ -0,0 +1,216 @@
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <system_error>
+
+#include "ocijail/copy.h"
+#include "ocijail/main.h"
+#include "ocijail/metrics.h"
+
+namespace ocijail {
+
+static void add_atomic(uint64_t& value, uint64_t n) {
+    std::atomic_ref<uint64_t>{value}.fetch_add(n, std::memory_order_relaxed);
+}
+
+static uint64_t load_atomic(const uint64_t& value) {
+    return std::atomic_ref<uint64_t>{const_cast<uint64_t&>(value)}.load(
+        std::memory_order_relaxed);
+}
+
+// Open the metrics file if it exists and has the layout we expect,
+// otherwise return -1. Once a file has been initialised it never changes
+// size or layout, so this doesn't need a lock.
+static int open_initialised(const std::filesystem::path& p) {
+    using layout = metrics_file::layout;
+    auto fd = ::open(p.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return -1;
+        }
+        throw std::system_error{
+            errno, std::system_category(), "opening " + p.native()};
+    }
+    struct stat st;
+    layout header{};
+    if (::fstat(fd, &st) == 0 && st.st_size == sizeof(layout) &&
+        ::pread(fd, &header, sizeof(uint64_t), 0) == sizeof(uint64_t) &&
+        header.magic == layout::MAGIC && header.version == layout::VERSION) {
+        return fd;
+    }
+    ::close(fd);
+    return -1;
+}
+
+// Create the metrics file, or replace one with another layout. Processes
+// which are still running may have the old file mapped, so the new one is
+// written separately and renamed into place rather than truncating the old
+// one under them. Initialisation is serialised by locking the file which is
+// at the path when we start, and the path is checked again under the lock
+// in case another process replaced it while we waited.
+static int initialise(const std::filesystem::path& p) {
+    using layout = metrics_file::layout;
+    fd_guard lock{::open(p.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600)};
+    if (lock.fd < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "opening " + p.native()};
+    }
+    if (::flock(lock.fd, LOCK_EX) < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "locking metrics"};
+    }
+    auto fd = open_initialised(p);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    auto tmp = p;
+    tmp += "." + std::to_string(::getpid());
+    fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "creating " + tmp.native()};
+    }
+    layout header{};
+    header.magic = layout::MAGIC;
+    header.version = layout::VERSION;
+    if (::pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        ::rename(tmp.c_str(), p.c_str()) < 0) {
+        auto err = errno;
+        ::close(fd);
+        ::unlink(tmp.c_str());
+        throw std::system_error{
+            err, std::system_category(), "initialising metrics"};
+    }
+    return fd;
+}
+
+metrics_file::metrics_file(const std::filesystem::path& state_db) {
+    auto p = path(state_db);
+    fd_ = open_initialised(p);
+    if (fd_ < 0) {
+        fd_ = initialise(p);
+    }
+
+    auto data = ::mmap(
+        nullptr, sizeof(layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+        auto err = errno;
+        ::close(fd_);
+        throw std::system_error{err, std::system_category(), "mapping metrics"};
+    }
+    data_ = static_cast<layout*>(data);
+}
+
+metrics_file::~metrics_file() {
+    ::munmap(data_, sizeof(layout));
+    ::close(fd_);
+}
+
+void metrics_file::record(std::string_view command,
+                          bool success,
+                          uint64_t duration) {
+    auto it = std::find(commands.begin(), commands.end(), command);
+    if (it == commands.end()) {
+        return;
+    }
+    auto& stats = data_->stats[it - commands.begin()];
+    add_atomic(success ? stats.success : stats.failure, 1);
+    add_atomic(stats.duration_sum, duration);
+    auto b = std::lower_bound(
+        bucket_bounds.begin(), bucket_bounds.end(), duration);
+    add_atomic(stats.buckets[b - bucket_bounds.begin()], 1);
+}
+
+void metrics_file::add(metric_counter counter, uint64_t value) {
+    add_atomic(data_->counters[size_t(counter)], value);
+}
+
+void metrics_file::write_prometheus(std::ostream& out) const {
+    out << "# HELP ocijail_command_duration_seconds Duration of ocijail "
+           "commands.\n"
+        << "# TYPE ocijail_command_duration_seconds histogram\n";
+    for (size_t i = 0; i < commands.size(); i++) {
+        auto& stats = data_->stats[i];
+        auto count = load_atomic(stats.success) + load_atomic(stats.failure);
+        if (count == 0) {
+            continue;
+        }
+        std::string label = "command=\"" + std::string{commands[i]} + "\"";
+        uint64_t total = 0;
+        for (size_t b = 0; b <= bucket_bounds.size(); b++) {
+            total += load_atomic(stats.buckets[b]);
+            out << "ocijail_command_duration_seconds_bucket{" << label
+                << ",le=\"";
+            if (b < bucket_bounds.size()) {
+                out << bucket_bounds[b] / 1e6;
+            } else {
+                out << "+Inf";
+            }
+            out << "\"} " << total << "\n";
+        }
+        auto sum = load_atomic(stats.duration_sum);
+        out << "ocijail_command_duration_seconds_sum{" << label << "} "
+            << sum / 1000000 << "." << std::setw(6) << std::setfill('0')
+            << sum % 1000000 << "\n"
+            << "ocijail_command_duration_seconds_count{" << label << "} "
+            << total << "\n";
+    }
+
+    out << "# HELP ocijail_commands_total Completed ocijail commands.\n"
+        << "# TYPE ocijail_commands_total counter\n";
+    for (size_t i = 0; i < commands.size(); i++) {
+        auto& stats = data_->stats[i];
+        auto success = load_atomic(stats.success);
+        auto failure = load_atomic(stats.failure);
+        if (success + failure == 0) {
+            continue;
+        }
+        out << "ocijail_commands_total{command=\"" << commands[i]
+            << "\",outcome=\"success\"} " << success << "\n"
+            << "ocijail_commands_total{command=\"" << commands[i]
+            << "\",outcome=\"failure\"} " << failure << "\n";
+    }
+
+    struct {
+        metric_counter counter;
+        const char* name;
+        const char* help;
+    } counters[] = {
+        {metric_counter::MOUNTS, "ocijail_mounts_total", "Volumes mounted."},
+        {metric_counter::HOOKS, "ocijail_hooks_total", "Hooks executed."},
+        {metric_counter::TMPCOPYUP_BYTES,
+         "ocijail_tmpcopyup_bytes_total",
+         "Bytes copied for tmpcopyup mounts."},
+    };
+    for (auto& c : counters) {
+        out << "# HELP " << c.name << " " << c.help << "\n"
+            << "# TYPE " << c.name << " counter\n"
+            << c.name << " " << load_atomic(data_->counters[size_t(c.counter)])
+            << "\n";
+    }
+}
+
+void metrics::init(main_app& app) {
+    static metrics instance{app};
+}
+
+metrics::metrics(main_app& app) : app_(app) {
+    auto sub = app.add_subcommand(
+        "metrics",
+        "Print command latencies and counters in Prometheus text format");
+    sub->final_callback([this] { run(); });
+}
+
+void metrics::run() {
+    std::filesystem::create_directories(app_.get_state_db());
+    metrics_file{app_.get_state_db()}.write_prometheus(std::cout);
+}
+
+}  // namespace ocijail
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+namespace ocijail {
+
+class main_app;
+
+// Counters which commands accumulate while they run
+enum class metric_counter {
+    MOUNTS,           // volumes mounted
+    HOOKS,            // hooks executed
+    TMPCOPYUP_BYTES,  // bytes copied by the tmpcopyup mount option
+    COUNT_,
+};
+
+// Aggregate statistics for all invocations, kept in a fixed-size file in the
+// state database which each process maps and updates with atomic operations.
+class metrics_file {
+   public:
+    // The commands we keep statistics for. Anything else is ignored.
+    static constexpr std::array<std::string_view, 12> commands{
+        "create",
+        "start",
+        "delete",
+        "exec",
+        "kill",
+        "state",
+        "list",
+        "features",
+        "events",
+        "wait",
+        "serve",
+        "metrics",
+    };
+
+    // Upper bounds of the duration histogram buckets in microseconds. The
+    // last bucket counts everything larger.
+    static constexpr std::array<uint64_t, 13> bucket_bounds{
+        1000,
+        2500,
+        5000,
+        10000,
+        25000,
+        50000,
+        100000,
+        250000,
+        500000,
+        1000000,
+        2500000,
+        5000000,
+        10000000,
+    };
+
+    struct command_stats {
+        uint64_t success;
+        uint64_t failure;
+        uint64_t duration_sum;
+        uint64_t buckets[bucket_bounds.size() + 1];
+    };
+
+    struct layout {
+        static constexpr uint32_t MAGIC = 0x6f636d74;  // "ocmt"
+        static constexpr uint32_t VERSION = 1;
+
+        uint32_t magic;
+        uint32_t version;
+        command_stats stats[commands.size()];
+        uint64_t counters[size_t(metric_counter::COUNT_)];
+    };
+
+    static std::filesystem::path path(const std::filesystem::path& state_db) {
+        return state_db / ".metrics";
+    }
+
+    // Map the metrics file, creating it if necessary
+    explicit metrics_file(const std::filesystem::path& state_db);
+    metrics_file(const metrics_file&) = delete;
+    ~metrics_file();
+
+    // Record one invocation of a command
+    void record(std::string_view command, bool success, uint64_t duration);
+    void add(metric_counter counter, uint64_t value);
+
+    // Render the statistics in the Prometheus text exposition format
+    void write_prometheus(std::ostream& out) const;
+
+   private:
+    int fd_;
+    layout* data_;
+};
+
+struct metrics {
+    static void init(main_app& app);
+
+   private:
+    metrics(main_app& app);
+    void run();
+
+    main_app& app_;
+};
+
+}  // namespace ocijail
@@ -0,0 +1,108 @@
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <climits>
+#include <ctime>
+
+#include "ocijail/monitor.h"
+#include "ocijail/notify.h"
+
+namespace ocijail {
+
+static void run_monitor(const std::filesystem::path& state_dir,
+                        const std::string& id,
+                        pid_t pid) {
+    // Wait for the container process to exit. If it has already gone, we
+    // don't know its exit status.
+    int status = -1;
+    notifier n;
+    if (n.watch_process(pid)) {
+        for (;;) {
+            auto ev = n.wait();
+            if (ev && ev->kind == notifier::event::PROCESS_EXIT &&
+                ev->ident == pid) {
+                status = ev->status;
+                break;
+            }
+        }
+    }
+    ::timespec now;
+    ::clock_gettime(CLOCK_REALTIME, &now);
+
+    // The container may have been deleted while we were waiting
+    runtime_state state{state_dir, id};
+    if (!state.exists()) {
+        return;
+    }
+    auto lk = state.lock();
+    state.load();
+    if (state.pid() == pid) {
+        state.update_exit(status, now);
+    }
+}
+
+pid_t start_monitor(const runtime_state& state, pid_t pid) {
+    auto state_dir = state.get_state_dir();
+    std::string id{state.get_id()};
+
+    // Fork twice so that the monitor is not our child and is not in the
+    // caller's session. The intermediate child passes the monitor's pid
+    // back through a pipe.
+    int fds[2];
+    if (::pipe2(fds, O_CLOEXEC) < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "creating monitor pipe"};
+    }
+    auto child = ::fork();
+    if (child < 0) {
+        auto err = errno;
+        ::close(fds[0]);
+        ::close(fds[1]);
+        throw std::system_error{
+            err, std::system_category(), "forking container monitor"};
+    }
+    if (child) {
+        ::close(fds[1]);
+        pid_t monitor_pid = 0;
+        auto n = ::read(fds[0], &monitor_pid, sizeof(monitor_pid));
+        ::close(fds[0]);
+        int status;
+        if (::waitpid(child, &status, 0) < 0) {
+            throw std::system_error{
+                errno, std::system_category(), "waiting for monitor"};
+        }
+        if (n != sizeof(monitor_pid) || monitor_pid <= 0) {
+            throw std::runtime_error("starting container monitor failed");
+        }
+        return monitor_pid;
+    }
+    ::close(fds[0]);
+    ::setsid();
+    auto monitor_pid = ::fork();
+    if (monitor_pid != 0) {
+        if (monitor_pid > 0) {
+            (void)!::write(fds[1], &monitor_pid, sizeof(monitor_pid));
+        }
+        ::_exit(0);
+    }
+    ::close(fds[1]);
+
+    // Don't hold on to anything inherited from create, in particular the
+    // caller's stdout and stderr pipes and the state lock.
+    auto null_fd = ::open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        ::dup2(null_fd, 0);
+        ::dup2(null_fd, 1);
+        ::dup2(null_fd, 2);
+    }
+    ::close_range(3, INT_MAX, 0);
+
+    try {
+        run_monitor(state_dir, id, pid);
+    } catch (...) {
+        ::_exit(1);
+    }
+    ::_exit(0);
+}
+
+}  // namespace ocijail
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include "ocijail/main.h"
+
+namespace ocijail {
+
+// Start a detached process which waits for the container process to exit and
+// records its exit status and time in the container state. The monitor is
+// not the parent of the container process so the caller of create remains
+// responsible for reaping it. Returns the pid of the monitor.
+pid_t start_monitor(const runtime_state& state, pid_t pid);
+
+}  // namespace ocijail
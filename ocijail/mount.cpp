@@ -1,13 +1,27 @@
 #include <sys/param.h>
 
+#include <fcntl.h>
 #include <spawn.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <utility>
 
+#include "ocijail/capabilities.h"
+#include "ocijail/copy.h"
+#include "ocijail/copyup.h"
+#include "ocijail/journal.h"
 #include "ocijail/main.h"
 #include "ocijail/mount.h"
+#include "ocijail/mount_tasks.h"
 
 extern "C" char** environ;
 
@@ -74,9 +88,11 @@ struct pseudo_option {
 
     std::string_view type;
     std::string_view optkey;
-    virtual void before_mount(const fs::path& destination,
+    virtual void before_mount(main_app& app,
+                              const fs::path& destination,
                               std::string_view optval) = 0;
-    virtual void after_mount(const fs::path& destination,
+    virtual void after_mount(main_app& app,
+                             const fs::path& destination,
                              std::string_view optval) = 0;
 
    private:
@@ -85,35 +101,124 @@ struct pseudo_option {
 
 std::vector<pseudo_option*> pseudo_option::handlers_;
 
+// Copy the original contents of the destination into the new tmpfs. A
+// descriptor for the destination is opened before mounting so that the
+// covered directory can still be read and copied in a single pass.
 struct tmpcopyup_option : pseudo_option {
     using pseudo_option::pseudo_option;
 
-    void before_mount(const fs::path& destination,
+    void before_mount(main_app& app,
+                      const fs::path& destination,
                       std::string_view optval) override {
-        char dir_template[] = "/tmp/tmpcopyup.XXXXXXXX";
-        tmp_copy = mkdtemp(dir_template);
-        fs::copy(destination,
-                 tmp_copy,
-                 fs::copy_options::recursive | fs::copy_options::copy_symlinks);
+        auto fd = ::open(
+            destination.c_str(), O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error{errno,
+                                    std::system_category(),
+                                    "opening " + destination.native()};
+        }
+        std::lock_guard lk{mutex};
+        auto [it, inserted] = originals.try_emplace(destination, fd);
+        if (!inserted) {
+            ::close(it->second);
+            it->second = fd;
+        }
     }
 
-    void after_mount(const fs::path& destination,
+    void after_mount(main_app& app,
+                     const fs::path& destination,
                      std::string_view optval) override {
-        fs::copy(tmp_copy,
-                 destination,
-                 fs::copy_options::recursive | fs::copy_options::copy_symlinks);
+        int src;
+        {
+            std::lock_guard lk{mutex};
+            auto node = originals.extract(destination);
+            src = node.mapped();
+        }
+        auto dst = ::open(destination.c_str(), O_DIRECTORY | O_CLOEXEC);
+        if (dst < 0) {
+            auto err = errno;
+            ::close(src);
+            throw std::system_error{
+                err, std::system_category(), "opening " + destination.native()};
+        }
+        copy_stats stats;
+        try {
+            stats = copy_up(app, src, dst);
+        } catch (...) {
+            ::close(src);
+            ::close(dst);
+            throw;
+        }
+        ::close(src);
+        ::close(dst);
+        app.count(metric_counter::TMPCOPYUP_BYTES, stats.bytes);
+        OCIJAIL_LOG_DEBUG(app)
+                .field("destination", destination.native())
+                .field("files", stats.files)
+                .field("bytes", stats.bytes)
+            << "tmpcopyup";
     }
 
-    fs::path tmp_copy;
+    // Restore the tree from the copy-up cache if we have seen it before,
+    // otherwise copy it and add it to the cache
+    copy_stats copy_up(main_app& app, int src, int dst) {
+        std::optional<copyup_cache> cache;
+        if (app.get_test_mode() == test_mode::NONE &&
+            app.get_copyup_cache_size() > 0 &&
+            fs::is_directory(app.get_state_db())) {
+            cache.emplace(app.get_state_db(), app.get_copyup_cache_size());
+        }
+        uint64_t fingerprint = 0;
+        // The cache is only an optimisation so any problem with it falls back
+        // to copying. A damaged archive is removed by restore and replaced
+        // by store.
+        if (cache) {
+            try {
+                fingerprint = copyup_cache::fingerprint(src);
+            } catch (const std::exception& e) {
+                OCIJAIL_LOG_DEBUG(app).field("error", e.what())
+                    << "fingerprinting tmpcopyup source failed";
+                cache.reset();
+            }
+        }
+        if (cache) {
+            try {
+                if (auto stats = cache->restore(fingerprint, dst)) {
+                    OCIJAIL_LOG_DEBUG(app) << "restored tmpcopyup from cache";
+                    return *stats;
+                }
+            } catch (const std::exception& e) {
+                OCIJAIL_LOG_DEBUG(app).field("error", e.what())
+                    << "restoring tmpcopyup from cache failed";
+            }
+        }
+        auto stats = copy_tree(src, dst, max_mount_jobs);
+        if (cache) {
+            try {
+                cache->store(fingerprint, dst);
+            } catch (const std::exception& e) {
+                OCIJAIL_LOG_DEBUG(app).field("error", e.what())
+                    << "saving tmpcopyup cache failed";
+            }
+        }
+        return stats;
+    }
+
+    // Mounts may be made concurrently so the descriptors for the original
+    // directories are kept per destination
+    std::mutex mutex;
+    std::map<fs::path, int> originals;
 } tmpcopyup_handler{"tmpfs", "tmpcopyup"};
 
 struct devfs_rule_option : pseudo_option {
     using pseudo_option::pseudo_option;
 
-    void before_mount(const fs::path& destination,
+    void before_mount(main_app& app,
+                      const fs::path& destination,
                       std::string_view optval) override {}
 
-    void after_mount(const fs::path& destination,
+    void after_mount(main_app& app,
+                     const fs::path& destination,
                      std::string_view rule) override {
         std::vector<std::string> args;
         std::vector<char*> argv;
@@ -179,66 +284,199 @@ static std::tuple<fs::path, fs::path> get_save_path(
     return std::make_tuple(save_dir, save_path);
 }
 
-static fs::path resolve_container_path_impl(main_app& app,
-                                            const fs::path& root_path,
-                                            fs::path resolved_path,
-                                            const fs::path& path,
-                                            int depth) {
-    app.log_debug() << "depth: " << depth << ", root_path: " << root_path
-                    << ", resolved_path: " << resolved_path
-                    << ", path: " << path;
-    if (depth >= MAXSYMLINKS) {
-        throw std::system_error{
-            ELOOP, std::system_category(), "resolving mount path"};
+// Open relative, a path inside dirfd, one component at a time without
+// following symbolic links, so that nothing changed inside a container root
+// can take us outside it. Returns -1 with errno set on failure.
+static int open_nofollow(int dirfd, const fs::path& relative, int flags) {
+    fd_guard dir{::openat(dirfd, ".", O_DIRECTORY | O_CLOEXEC)};
+    if (dir.fd < 0) {
+        return -1;
     }
+    for (auto& element : relative.parent_path()) {
+        auto fd = ::openat(
+            dir.fd, element.c_str(), O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        ::close(dir.fd);
+        dir.fd = fd;
+    }
+    auto name = relative.filename();
+    return ::openat(dir.fd,
+                    name.empty() ? "." : name.c_str(),
+                    flags | O_NOFOLLOW | O_CLOEXEC);
+}
 
-    // We need to resolve any symbolic links on the path within the given root
-    // so that containers cannot mount anything outside root_path
-    for (const auto& element : path) {
-        app.log_debug() << "resolved_path: " << resolved_path
-                        << ", element: " << element;
-        if (element.is_absolute()) {
-            resolved_path = root_path;
-        } else {
-            fs::path tmp_path;
-            if (element.string() == "..") {
-                if (resolved_path == root_path) {
-                    // Don't allow ".." past root
-                    tmp_path = resolved_path;
-                } else {
-                    tmp_path = resolved_path.parent_path();
-                }
-            } else {
-                tmp_path = resolved_path / element;
-            }
-            if (fs::is_symlink(tmp_path)) {
-                auto target = fs::read_symlink(tmp_path);
-                if (target.is_absolute()) {
-                    while (target.is_absolute()) {
-                        target = fs::path{target.string().substr(1)};
-                    }
-                    resolved_path = resolve_container_path_impl(
-                        app, root_path, root_path, target, depth + 1);
-                } else {
-                    resolved_path = resolve_container_path_impl(
-                        app, root_path, resolved_path, target, depth + 1);
-                }
+// A directory in which a symbolic link was followed while resolving a path.
+// The path is relative to the container root and is empty for the root.
+struct link_dir {
+    std::string path;
+    ino_t ino;
+    timespec mtime;
+};
+
+// Resolve paths inside a container root one component at a time using
+// descriptors for each directory on the path, so that each component costs
+// one or two system calls and no symbolic link can take us outside the root.
+// Components following one which doesn't exist, or isn't a directory, are
+// appended without looking them up.
+class path_resolver {
+   public:
+    path_resolver(main_app& app, const fs::path& root_path)
+        : app_(app), path_(root_path.native()) {
+        while (path_.size() > 1 && path_.back() == '/') {
+            path_.pop_back();
+        }
+        auto fd = ::open(path_.c_str(), O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error{
+                errno, std::system_category(), "opening " + path_};
+        }
+        dirs_.push_back({fd, path_.size()});
+    }
+    ~path_resolver() {
+        for (auto& dir : dirs_) {
+            ::close(dir.fd);
+        }
+    }
+    path_resolver(const path_resolver&) = delete;
+    path_resolver& operator=(const path_resolver&) = delete;
+
+    void walk(const fs::path& path, int depth) {
+        OCIJAIL_LOG_DEBUG(app_) << "depth: " << depth
+                                << ", resolved_path: " << path_
+                                << ", path: " << path;
+        if (depth >= MAXSYMLINKS) {
+            throw std::system_error{
+                ELOOP, std::system_category(), "resolving mount path"};
+        }
+        for (const auto& element : path) {
+            auto& name = element.native();
+            if (element.has_root_directory()) {
+                to_root();
+            } else if (name.empty() || name == ".") {
+                continue;
+            } else if (name == "..") {
+                up();
+            } else if (unresolved_ > 0) {
+                append(name);
             } else {
-                resolved_path = tmp_path;
+                lookup(name, depth);
             }
         }
     }
-    assert(resolved_path.string().starts_with(root_path.string()));
 
-    return resolved_path;
-}
+    // If set, each directory where a symbolic link is followed is added to
+    // links
+    void record_links(std::vector<link_dir>* links) { links_ = links; }
 
-static fs::path resolve_container_path(main_app& app,
-                                       const fs::path& root_path,
-                                       const json& mount) {
-    fs::path path{mount["destination"]};
-    return resolve_container_path_impl(
-        app, root_path, root_path, fs::path{mount["destination"]}, 0);
+    // The path resolved so far, relative to the root
+    std::string relative_path() const {
+        return path_.substr(dirs_.front().len);
+    }
+
+    container_path finish() {
+        container_path res;
+        res.path = path_.empty() ? "/" : path_;
+        if (unresolved_ == 0) {
+            res.fd = dirs_.back().fd;
+            dirs_.pop_back();
+        }
+        return res;
+    }
+
+   private:
+    struct dir {
+        int fd;
+        // The length of path_ for this directory
+        size_t len;
+    };
+
+    void to_root() {
+        while (dirs_.size() > 1) {
+            ::close(dirs_.back().fd);
+            dirs_.pop_back();
+        }
+        path_.resize(dirs_.back().len);
+        unresolved_ = 0;
+    }
+
+    // Don't allow ".." past root
+    void up() {
+        if (unresolved_ > 0) {
+            path_.resize(path_.rfind('/'));
+            unresolved_--;
+        } else if (dirs_.size() > 1) {
+            ::close(dirs_.back().fd);
+            dirs_.pop_back();
+            path_.resize(dirs_.back().len);
+        }
+    }
+
+    void append(const std::string& name) {
+        path_ += '/';
+        path_ += name;
+        unresolved_++;
+    }
+
+    void lookup(const std::string& name, int depth) {
+        auto dirfd = dirs_.back().fd;
+        auto fd = ::openat(
+            dirfd, name.c_str(), O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0) {
+            path_ += '/';
+            path_ += name;
+            dirs_.push_back({fd, path_.size()});
+            return;
+        }
+        if (errno == ENOENT) {
+            append(name);
+            return;
+        }
+        // Depending on the platform, a symbolic link fails with ENOTDIR,
+        // ELOOP or EMLINK.
+        if (errno != ENOTDIR && errno != ELOOP && errno != EMLINK) {
+            throw std::system_error{
+                errno, std::system_category(), "resolving mount path"};
+        }
+        char target[PATH_MAX];
+        auto n = ::readlinkat(dirfd, name.c_str(), target, sizeof(target));
+        if (n < 0) {
+            if (errno != EINVAL) {
+                throw std::system_error{
+                    errno, std::system_category(), "resolving mount path"};
+            }
+            // Something other than a directory or a symbolic link
+            append(name);
+            return;
+        }
+        if (links_) {
+            struct stat st;
+            if (::fstat(dirfd, &st) < 0) {
+                throw std::system_error{
+                    errno, std::system_category(), "resolving mount path"};
+            }
+            links_->push_back({relative_path(), st.st_ino, st.st_mtim});
+        }
+        walk(fs::path{std::string{target, size_t(n)}}, depth + 1);
+    }
+
+    main_app& app_;
+    std::string path_;
+    std::vector<dir> dirs_;
+    // The number of components at the end of path_ which were not looked up
+    int unresolved_ = 0;
+    std::vector<link_dir>* links_ = nullptr;
+};
+
+// We need to resolve any symbolic links on the path within the given root
+// so that containers cannot mount anything outside root_path
+static container_path resolve_container_path(main_app& app,
+                                             const fs::path& root_path,
+                                             const oci_mount& mount) {
+    path_resolver resolver{app, root_path};
+    resolver.walk(fs::path{mount.destination}, 0);
+    return resolver.finish();
 }
 
 void apply_devfs_rule(const fs::path& destination, std::string_view rule) {
@@ -285,17 +523,16 @@ void apply_devfs_rule(const fs::path& destination, std::string_view rule) {
     }
 }
 
-// Similar to fs::create_directories but track our actions in the
-// runtime state.
+// Similar to fs::create_directories but record our actions in the mount
+// journal.
 static void create_directories(const fs::path& root_path,
                                const fs::path& path,
-                               runtime_state& state) {
+                               mount_journal& journal) {
     if (path == root_path || fs::exists(path)) {
         return;
     }
-    // Make sure that directories are removed in reverse order
-    state["remove_on_unmount"].push_back(path);
-    create_directories(root_path, path.parent_path(), state);
+    journal.create_directory(path);
+    create_directories(root_path, path.parent_path(), journal);
     fs::create_directory(path);
 }
 
@@ -315,19 +552,21 @@ int do_mount(
     return nmount(&iov[0], iov.size(), mount_flags | MNT_IGNORE);
 }
 
-static bool create_mount_point(runtime_state& state,
+static bool create_mount_point(mount_journal& journal,
                                const fs::path& root_path,
-                               const fs::path& destination,
+                               const container_path& mount_point,
                                bool is_file_mount) {
-    auto destination_exists = fs::exists(destination);
+    auto& destination = mount_point.path;
+    // The resolver only holds a descriptor for existing directories
+    auto destination_exists = mount_point.fd >= 0 || fs::exists(destination);
     if (destination_exists) {
         if (is_file_mount) {
-            if (!fs::is_regular_file(destination)) {
+            if (mount_point.fd >= 0 || !fs::is_regular_file(destination)) {
                 throw std::runtime_error(
                     "destination for file mount exists and is not a file");
             }
         } else {
-            if (!fs::is_directory(destination)) {
+            if (mount_point.fd < 0) {
                 throw std::runtime_error(
                     "destination for non-file mount exists and is not a "
                     "directory");
@@ -337,36 +576,102 @@ static bool create_mount_point(runtime_state& state,
         if (is_file_mount) {
             // Create parent directories if necessary and create an
             // empty file to mount over
-            state["remove_on_unmount"].push_back(destination);
-            create_directories(root_path, destination.parent_path(), state);
+            journal.create_file(destination);
+            create_directories(root_path, destination.parent_path(), journal);
             std::ofstream{destination} << "";
         } else {
-            create_directories(root_path, destination, state);
+            create_directories(root_path, destination, journal);
         }
     }
     return destination_exists;
 }
 
+// nmount takes a path rather than a descriptor, so check just before
+// mounting that the path still leads, without following symbolic links, to
+// the mount point which was prepared. Mounts are made before the container
+// process starts but the root may be shared with something else which is
+// running. This leaves only the time between the check and nmount for the
+// path to be changed.
+static void check_mount_point(const fs::path& root_path,
+                              const container_path& mount_point,
+                              bool is_file_mount) {
+    auto& destination = mount_point.path;
+    auto root = normalise_path(root_path);
+    auto path = normalise_path(destination);
+    if (path != root && !path_contains(root, path)) {
+        throw std::runtime_error(
+            "mount point " + destination.native() + " is outside the root");
+    }
+    fd_guard root_fd{::open(root.c_str(), O_DIRECTORY | O_CLOEXEC)};
+    if (root_fd.fd < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "opening " + root.native()};
+    }
+    fd_guard fd{open_nofollow(
+        root_fd.fd, path.lexically_relative(root), O_RDONLY | O_NONBLOCK)};
+    struct stat st;
+    if (fd.fd < 0 || ::fstat(fd.fd, &st) < 0) {
+        throw std::system_error{errno,
+                                std::system_category(),
+                                "checking mount point " + destination.native()};
+    }
+    bool changed;
+    if (mount_point.fd >= 0) {
+        struct stat expected;
+        if (::fstat(mount_point.fd, &expected) < 0) {
+            throw std::system_error{
+                errno,
+                std::system_category(),
+                "checking mount point " + destination.native()};
+        }
+        changed =
+            st.st_dev != expected.st_dev || st.st_ino != expected.st_ino;
+    } else {
+        changed = is_file_mount ? !S_ISREG(st.st_mode) : !S_ISDIR(st.st_mode);
+    }
+    if (changed) {
+        throw std::runtime_error(
+            "mount point " + destination.native() + " changed while mounting");
+    }
+}
+
+// The shared state for the mounts of one call to mount_volumes, which may be
+// made on several threads.
+struct mount_context {
+    main_app& app;
+    runtime_state& state;
+    const fs::path& root_path;
+    bool prepare_only;
+    mount_journal& journal;
+    // Cleared if we find that the kernel can't mount files
+    std::atomic<bool> file_mount_supported{true};
+    // Set once a file mount has shown whether file_mount_supported is right
+    std::atomic<bool> file_mount_probed{false};
+    // Serialises creating mount points and save directories, which may
+    // share parent directories.
+    std::mutex mutex;
+};
+
 // If prepare_only is true, validate the mount and create the mount point if
 // necessary but don't actually mount. This is used to support read-only roots
 // where we need to prepare mount points in the read-write rootfs before we make
 // a read-only alias using nullfs.
-static bool mount_volume(main_app& app,
-                         bool file_mount_supported,
-                         runtime_state& state,
-                         const fs::path& root_path,
-                         bool prepare_only,
-                         const json& mount) {
-    auto destination = resolve_container_path(app, root_path, mount);
-
-    std::string type = mount.contains("type") ? mount["type"] : "nullfs";
+static void mount_volume(mount_context& ctx,
+                         const oci_mount& mount,
+                         const container_path& mount_point) {
+    auto& destination = mount_point.path;
+    auto& app = ctx.app;
+    auto& state = ctx.state;
+    auto span = app.trace("mount_volume", {{"destination", mount.destination}});
+
+    std::string type = mount.type.value_or("nullfs");
     if (type == "bind") {
         // TODO: remove this when podman syncs with buildah fixes to
         // avoid using "bind" on FreeBSD.
         type = "nullfs";
     }
-    bool is_file_mount =
-        type == "nullfs" && fs::is_regular_file(mount["source"]);
+    auto source = mount.source.value_or("");
+    bool is_file_mount = type == "nullfs" && fs::is_regular_file(source);
 
     // Validate mount options before we perform any actions
     std::vector<std::tuple<pseudo_option*, std::string>> pseudo_opts;
@@ -375,179 +680,732 @@ static bool mount_volume(main_app& app,
     mount_opts.emplace_back("fstype", type);
     mount_opts.emplace_back("fspath", destination);
     if (type == "nullfs") {
-        mount_opts.emplace_back("target", mount["source"]);
-    }
-    if (mount.contains("options")) {
-        for (auto& opt : mount["options"]) {
-            // Copy the string out of json to make life simpler
-            std::string optstring{opt};
-            auto [key, val] = split_option(optstring);
-
-            auto it = name_to_flag.find(key);
-            if (it != name_to_flag.end()) {
-                auto flag = it->second;
-                if (flag > 0) {
-                    mount_flags |= flag;
-                } else if (flag < 0) {
-                    mount_flags &= ~(-flag);
-                }
+        mount_opts.emplace_back("target", source);
+    }
+    for (auto& opt : mount.options) {
+        auto [key, val] = split_option(opt);
+
+        auto it = name_to_flag.find(key);
+        if (it != name_to_flag.end()) {
+            auto flag = it->second;
+            if (flag > 0) {
+                mount_flags |= flag;
+            } else if (flag < 0) {
+                mount_flags &= ~(-flag);
+            }
+            continue;
+        } else {
+            auto h = pseudo_option::lookup(type, key);
+            if (h != nullptr) {
+                pseudo_opts.emplace_back(h, val);
                 continue;
-            } else {
-                auto h = pseudo_option::lookup(type, key);
-                if (h != nullptr) {
-                    pseudo_opts.emplace_back(h, val);
-                    continue;
-                }
-                mount_opts.emplace_back(key, val);
             }
+            mount_opts.emplace_back(key, val);
         }
     }
 
-    auto destination_exists =
-        create_mount_point(state, root_path, destination, is_file_mount);
+    bool destination_exists;
+    {
+        std::lock_guard lk{ctx.mutex};
+        destination_exists = create_mount_point(
+            ctx.journal, ctx.root_path, mount_point, is_file_mount);
+    }
 
-    if (prepare_only) {
-        return file_mount_supported;
+    if (ctx.prepare_only) {
+        return;
     }
 
     for (auto& entry : pseudo_opts) {
-        std::get<0>(entry)->before_mount(destination, std::get<1>(entry));
+        std::get<0>(entry)->before_mount(
+            app, destination, std::get<1>(entry));
     }
 
 retry:
-    if (is_file_mount && !file_mount_supported) {
+    if (is_file_mount && !ctx.file_mount_supported) {
         // Mimic real file mounts by moving the original to a subdirectory if it
-        // existed and copying the source
-        if (destination_exists) {
-            auto [save_dir, save_path] = get_save_path(state, destination);
-            if (!fs::exists(save_dir)) {
-                fs::create_directories(save_dir);
-                state["remove_on_unmount"].push_back(save_dir);
+        // existed and putting the source in its place. Whatever is placed
+        // is removed on unmount, either as the file made by
+        // create_mount_point or when the original is restored.
+        {
+            std::lock_guard lk{ctx.mutex};
+            if (destination_exists) {
+                auto [save_dir, save_path] = get_save_path(state, destination);
+                if (!fs::exists(save_dir)) {
+                    ctx.journal.create_directory(save_dir);
+                    fs::create_directory(save_dir);
+                }
+                ctx.journal.save(destination, save_path);
+                fs::rename(destination, save_path);
+            } else {
+                // Remove the empty file made by create_mount_point
+                fs::remove(destination);
             }
-            fs::rename(destination, save_path);
         }
-        fs::copy_file(
-            mount["source"], destination, fs::copy_options::overwrite_existing);
+        // A link would let the container write to a read-only source
+        auto method =
+            place_file(source, destination, !(mount_flags & MNT_RDONLY));
+        OCIJAIL_LOG_DEBUG(app).field("method", to_string(method))
+            << "placed " << source << " at " << destination;
     } else {
         // Otherwise perform the actual mount.
+        check_mount_point(ctx.root_path, mount_point, is_file_mount);
+        ctx.journal.mount(destination);
         if (do_mount(mount_opts, mount_flags) < 0) {
-            if (is_file_mount && errno == ENOTDIR) {
-                file_mount_supported = false;
+            auto err = errno;
+            ctx.journal.abandoned(destination);
+            if (is_file_mount && err == ENOTDIR) {
+                ctx.file_mount_supported = false;
+                ctx.file_mount_probed = true;
                 goto retry;
             }
-            std::stringstream ss;
-            ss << mount;
             throw std::system_error(
-                errno, std::system_category(), "mounting " + ss.str());
+                err, std::system_category(), "mounting " + mount.destination);
+        }
+        ctx.journal.mounted(destination);
+        if (is_file_mount) {
+            ctx.file_mount_probed = true;
         }
     }
+    app.count(metric_counter::MOUNTS);
 
     for (auto& entry : pseudo_opts) {
-        std::get<0>(entry)->after_mount(destination, std::get<1>(entry));
+        std::get<0>(entry)->after_mount(app, destination, std::get<1>(entry));
+    }
+}
+
+// Unmount whatever is mounted on destination, a path inside the container
+// root which the container may have changed since the mount was made. The
+// path is opened one component at a time from the root without following
+// symbolic links, and the file system found there is unmounted by its id so
+// that a path swapped after the check can't redirect the unmount. A
+// destination which can't be reached that way is skipped.
+static void unmount_beneath(main_app& app,
+                            const fs::path& root_path,
+                            const fs::path& destination) {
+    auto root = normalise_path(root_path);
+    auto path = normalise_path(destination);
+    if (!path_contains(root, path)) {
+        OCIJAIL_LOG_WARN(app).field("destination", path.native())
+            << "not unmounting a path outside the container root";
+        return;
     }
+    auto skip = [&](int err) {
+        // Nothing can be mounted on a path which doesn't exist
+        if (err != ENOENT) {
+            OCIJAIL_LOG_WARN(app)
+                    .field("destination", path.native())
+                    .field("error", std::strerror(err))
+                << "not unmounting a path changed by the container";
+        }
+    };
 
-    return file_mount_supported;
+    fd_guard root_fd{::open(root.c_str(), O_DIRECTORY | O_CLOEXEC)};
+    if (root_fd.fd < 0) {
+        skip(errno);
+        return;
+    }
+    auto relative = path.lexically_relative(root);
+    fd_guard dir{
+        open_nofollow(root_fd.fd, relative.parent_path(), O_DIRECTORY)};
+    if (dir.fd < 0) {
+        skip(errno);
+        return;
+    }
+    struct statfs parent_st, st;
+    {
+        // Don't hold the mounted directory open while unmounting it
+        fd_guard target{::openat(dir.fd,
+                                 relative.filename().c_str(),
+                                 O_RDONLY | O_NONBLOCK | O_NOFOLLOW |
+                                     O_CLOEXEC)};
+        if (target.fd < 0) {
+            skip(errno);
+            return;
+        }
+        if (::fstatfs(dir.fd, &parent_st) < 0 ||
+            ::fstatfs(target.fd, &st) < 0) {
+            throw std::system_error{
+                errno, std::system_category(), "statfs " + path.native()};
+        }
+    }
+    if (st.f_fsid.val[0] == parent_st.f_fsid.val[0] &&
+        st.f_fsid.val[1] == parent_st.f_fsid.val[1]) {
+        // Not a mount point
+        return;
+    }
+    auto id = "FSID:" + std::to_string(st.f_fsid.val[0]) + ":" +
+              std::to_string(st.f_fsid.val[1]);
+    if (::unmount(id.c_str(), MNT_BYFSID | MNT_FORCE) < 0 &&
+        errno != EINVAL && errno != ENOENT) {
+        throw std::system_error{
+            errno, std::system_category(), "unmounting " + path.native()};
+    }
 }
 
+// Undo a mount for a container created before the mount journal
 static void unmount_volume(main_app& app,
                            bool file_mount_supported,
-                           runtime_state& state,
+                           const runtime_state& state,
                            const fs::path& root_path,
-                           const json& mount) {
-    auto destination = resolve_container_path(app, root_path, mount);
-
-    std::string type = mount.contains("type") ? mount["type"] : "nullfs";
+                           const oci_mount& mount,
+                           const fs::path& destination) {
+    std::string type = mount.type.value_or("nullfs");
     bool is_file_mount =
-        type == "nullfs" && fs::is_regular_file(mount["source"]);
+        type == "nullfs" && fs::is_regular_file(mount.source.value_or(""));
 
     if (is_file_mount && !file_mount_supported) {
-        // Restore the saved path if it exists
+        // Restore the saved path if it exists, replacing the copy or link.
+        // Otherwise the destination is removed with the other files which
+        // were created for the mounts.
         auto [_, save_path] = get_save_path(state, destination);
         if (fs::exists(save_path)) {
             fs::rename(save_path, destination);
         }
     } else {
-        if (::unmount(destination.c_str(), MNT_FORCE) < 0) {
-            // unmount will return EINVAL if the mount doesn't exist
-            if (errno == EINVAL) {
+        unmount_beneath(app, root_path, destination);
+    }
+}
+
+#ifdef O_RESOLVE_BENEATH
+static constexpr int resolve_beneath = O_RESOLVE_BENEATH;
+#else
+static constexpr int resolve_beneath = 0;
+#endif
+
+// The number of resolve caches kept in the state database
+static constexpr size_t max_resolve_caches = 64;
+
+// Resolved mount destinations for one container root, kept in a
+// .resolve-<device>-<inode> file in the state database so that creates using
+// a root which we have seen before can skip walking each destination. Only
+// destinations which are existing directories are cached.
+//
+// The whole cache is dropped if the modification time of the root changes.
+// Each entry is checked before use by opening the resolved path with
+// O_RESOLVE_BENEATH, which keeps the lookup inside the root, and comparing
+// the directory we get with the one which was cached. The directories where
+// symbolic links were followed are also checked so that a link which now
+// points somewhere else is noticed. If anything differs, the destination is
+// walked as usual and the entry replaced.
+class resolve_cache {
+   public:
+    resolve_cache(main_app& app, const fs::path& root_path)
+        : app_(app), root_path_(root_path), root_(root_path.native()) {
+        while (root_.size() > 1 && root_.back() == '/') {
+            root_.pop_back();
+        }
+        auto state_db = app.get_state_db();
+        if (resolve_beneath == 0 || app.get_test_mode() != test_mode::NONE ||
+            !fs::is_directory(state_db) ||
+            path_contains(normalise_path(state_db), normalise_path(root_))) {
+            // A read-only alias of the root lives in the state database and
+            // is different for each container.
+            return;
+        }
+        root_fd_ = ::open(root_.c_str(), O_DIRECTORY | O_CLOEXEC);
+        struct stat st;
+        if (root_fd_ < 0 || ::fstat(root_fd_, &st) < 0) {
+            return;
+        }
+        char name[48];
+        ::snprintf(name,
+                   sizeof(name),
+                   ".resolve-%llx-%llx",
+                   static_cast<unsigned long long>(st.st_dev),
+                   static_cast<unsigned long long>(st.st_ino));
+        path_ = state_db / name;
+        mtime_ = {st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+        try {
+            if (!fs::is_regular_file(path_)) {
                 return;
             }
-            throw std::system_error{
-                errno,
-                std::system_category(),
-                "unmounting " + mount["destination"].get<std::string>()};
+            mapped_file file{path_};
+            auto cache = json::parse(file.contents());
+            if (cache.at("mtime") == mtime_) {
+                entries_ = std::move(cache.at("paths"));
+                // The modification time records when the cache was last
+                // used
+                ::utimensat(AT_FDCWD, path_.c_str(), nullptr, 0);
+            } else {
+                modified_ = true;
+            }
+        } catch (const std::exception& e) {
+            OCIJAIL_LOG_DEBUG(app).field("error", e.what())
+                << "loading resolve cache failed";
+            modified_ = true;
+        }
+    }
+    ~resolve_cache() {
+        if (root_fd_ >= 0) {
+            ::close(root_fd_);
+        }
+    }
+    resolve_cache(const resolve_cache&) = delete;
+    resolve_cache& operator=(const resolve_cache&) = delete;
+
+    container_path resolve(const oci_mount& mount) {
+        if (path_.empty()) {
+            return resolve_container_path(app_, root_path_, mount);
+        }
+        auto it = entries_.find(mount.destination);
+        if (it != entries_.end()) {
+            auto res = lookup(*it);
+            if (res.fd >= 0) {
+                return res;
+            }
+        }
+
+        std::vector<link_dir> links;
+        path_resolver resolver{app_, root_path_};
+        resolver.record_links(&links);
+        resolver.walk(fs::path{mount.destination}, 0);
+        auto relative_path = resolver.relative_path();
+        auto res = resolver.finish();
+        struct stat st;
+        if (res.fd >= 0 && ::fstat(res.fd, &st) == 0) {
+            auto entry = json{{"path", relative_path},
+                              {"dev", st.st_dev},
+                              {"ino", st.st_ino},
+                              {"links", json::array()}};
+            for (auto& link : links) {
+                entry["links"].push_back({link.path,
+                                          link.ino,
+                                          link.mtime.tv_sec,
+                                          link.mtime.tv_nsec});
+            }
+            entries_[mount.destination] = std::move(entry);
+            modified_ = true;
+        } else if (it != entries_.end()) {
+            entries_.erase(mount.destination);
+            modified_ = true;
+        }
+        return res;
+    }
+
+    // Write the cache if it changed. Errors are ignored since the cache is
+    // only an optimisation.
+    void save() {
+        if (path_.empty() || !modified_) {
+            return;
+        }
+        try {
+            if (!fs::exists(path_)) {
+                evict(app_.get_state_db());
+            }
+            auto cache = json{
+                {"root", root_}, {"mtime", mtime_}, {"paths", entries_}};
+            auto tmp = path_;
+            tmp += "." + std::to_string(::getpid());
+            {
+                std::ofstream out{tmp};
+                out << cache.dump();
+                if (!out) {
+                    throw std::runtime_error("writing " + tmp.native());
+                }
+            }
+            fs::rename(tmp, path_);
+        } catch (const std::exception& e) {
+            OCIJAIL_LOG_DEBUG(app_).field("error", e.what())
+                << "saving resolve cache failed";
+        }
+    }
+
+   private:
+    // Return the cached destination, or a container_path with no descriptor
+    // if the entry is out of date.
+    container_path lookup(const json& entry) {
+        container_path res;
+        try {
+            struct stat st;
+            for (auto& link : entry.at("links")) {
+                auto path = "." + link.at(0).get<std::string>();
+                auto err = ::fstatat(
+                    root_fd_, path.c_str(), &st, AT_SYMLINK_NOFOLLOW);
+                if (err < 0 || st.st_ino != link.at(1) ||
+                    st.st_mtim.tv_sec != link.at(2) ||
+                    st.st_mtim.tv_nsec != link.at(3)) {
+                    return res;
+                }
+            }
+            auto relative_path = entry.at("path").get<std::string>();
+            res.fd = ::openat(
+                root_fd_,
+                ("." + relative_path).c_str(),
+                O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC | resolve_beneath);
+            if (res.fd < 0 || ::fstat(res.fd, &st) < 0 ||
+                st.st_dev != entry.at("dev") || st.st_ino != entry.at("ino")) {
+                res.close();
+                return res;
+            }
+            res.path = root_ + relative_path;
+        } catch (const json::exception&) {
+            res.close();
+        }
+        return res;
+    }
+
+    // Make room for a new cache by removing the least recently used ones,
+    // which also removes the caches of roots which no longer exist. Podman
+    // usually gives each container a new root so this only looks at the
+    // file times rather than reading each cache.
+    static void evict(const fs::path& state_db) {
+        struct cache_file {
+            fs::path path;
+            fs::file_time_type used;
+        };
+        std::vector<cache_file> caches;
+        for (auto& entry : fs::directory_iterator{state_db}) {
+            auto name = entry.path().filename().native();
+            // Skip files which are still being written
+            if (!name.starts_with(".resolve-") ||
+                name.find('.', 1) != name.npos) {
+                continue;
+            }
+            std::error_code ec;
+            auto used = entry.last_write_time(ec);
+            if (!ec) {
+                caches.push_back({entry.path(), used});
+            }
+        }
+        if (caches.size() < max_resolve_caches) {
+            return;
+        }
+        std::sort(caches.begin(), caches.end(), [](auto& a, auto& b) {
+            return a.used < b.used;
+        });
+        for (size_t i = 0; i <= caches.size() - max_resolve_caches; i++) {
+            std::error_code ec;
+            fs::remove(caches[i].path, ec);
+        }
+    }
+
+    main_app& app_;
+    const fs::path& root_path_;
+    // root_path without any trailing slash
+    std::string root_;
+    int root_fd_ = -1;
+    // The cache file, or empty if the cache is not used
+    fs::path path_;
+    json mtime_;
+    json entries_ = json::object();
+    bool modified_ = false;
+};
+
+// If hold_fds is false, descriptors for the resolved destinations are closed
+// straight away, e.g. so that they don't keep mounts busy. If cache is set,
+// it is used to resolve the destinations.
+static std::vector<mount_task> plan_mounts(
+    main_app& app,
+    const fs::path& root_path,
+    const std::vector<oci_mount>& mounts,
+    bool hold_fds,
+    resolve_cache* cache) {
+    auto span = app.trace("resolve_container_path");
+    std::vector<mount_task> tasks;
+    tasks.reserve(mounts.size());
+    for (auto& mount : mounts) {
+        auto& task = tasks.emplace_back();
+        task.mount = &mount;
+        task.destination = normalise_path(fs::path{"/"} / mount.destination);
+        auto type = mount.type.value_or("nullfs");
+        task.nullfs = type == "nullfs" || type == "bind";
+        try {
+            if (cache) {
+                task.resolved = cache->resolve(mount);
+            } else {
+                task.resolved = resolve_container_path(app, root_path, mount);
+            }
+            if (!hold_fds) {
+                task.resolved.close();
+            }
+        } catch (const std::exception&) {
+            // Report the error when the task runs, after the mounts which
+            // come before it.
+            task.barrier = true;
+        }
+    }
+    link_mount_tasks(tasks);
+    return tasks;
+}
+
+// Return the destination for a task, resolving it again if tasks which ran
+// before it may have changed what it resolves to.
+static container_path task_destination(main_app& app,
+                                       const fs::path& root_path,
+                                       mount_task& task,
+                                       bool reverse) {
+    auto& waited_for = reverse ? task.dependents : task.dependencies;
+    if (waited_for.empty() && !task.resolved.path.empty()) {
+        return std::move(task.resolved);
+    }
+    auto span = app.trace("resolve_container_path");
+    return resolve_container_path(app, root_path, *task.mount);
+}
+
+// Remove directories which can't contain each other in parallel, trying all
+// of them and rethrowing the first error
+static void remove_directories(const std::vector<std::string>& paths) {
+    std::atomic<size_t> next{0};
+    std::mutex mutex;
+    std::exception_ptr error;
+    run_workers(std::min(max_mount_jobs, paths.size()), [&] {
+        for (;;) {
+            auto i = next++;
+            if (i >= paths.size()) {
+                break;
+            }
+            try {
+                if (fs::exists(paths[i])) {
+                    fs::remove(paths[i]);
+                }
+            } catch (...) {
+                std::lock_guard lk{mutex};
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
         }
+    });
+    if (error) {
+        std::rethrow_exception(error);
     }
 }
 
+// Remove the files and directories which we created, trying all of them and
+// setting eptr to the first error if it isn't already set. We need to remove
+// subdirectories before parents. The order in which they were created is not
+// enough - if two mounts are made to the same parent directory (e.g.
+// /data/foo, /data/bar), then the parent removal needs to happen after both
+// subdirectories are removed.
+//
+// Paths are grouped by depth and removed a level at a time, deepest first.
+// Paths at the same depth can't contain each other so each level is removed
+// in parallel.
+static void remove_created(const std::vector<std::string>& created,
+                           std::exception_ptr& eptr) {
+    std::map<size_t, std::vector<std::string>, std::greater<>> levels;
+    for (auto& created_path : created) {
+        fs::path path = created_path;
+        auto depth = std::distance(path.begin(), path.end());
+        levels[depth].push_back(path);
+    }
+    for (auto& [depth, paths] : levels) {
+        std::sort(paths.begin(), paths.end());
+        paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+        try {
+            remove_directories(paths);
+        } catch (...) {
+            if (!eptr) {
+                eptr = std::current_exception();
+            }
+        }
+    }
+}
+
+// Undo the changes recorded in a mount journal. Nothing is resolved in the
+// container's root, which may have been changed by the container. Mounts are
+// removed by file system id. A mount which was interrupted before its id was
+// recorded is looked up with unmount_beneath, which won't follow anything the
+// container may have changed. Overlapping mounts are removed latest first
+// and others in parallel. Then saved files are restored and the files and
+// directories which we created are removed.
+static void replay_journal(main_app& app,
+                           const fs::path& root_path,
+                           mount_journal& journal) {
+    auto span = app.trace("replay mount journal");
+    std::vector<mount_task> tasks;
+    std::vector<std::optional<std::array<int32_t, 2>>> fsids;
+    std::vector<std::tuple<fs::path, fs::path>> saves;
+    std::vector<std::string> created;
+    for (auto& r : journal.read()) {
+        switch (r.kind) {
+        case mount_journal::record::MOUNT: {
+            auto& task = tasks.emplace_back();
+            task.mount = nullptr;
+            task.destination = normalise_path(r.path);
+            fsids.emplace_back();
+            break;
+        }
+        case mount_journal::record::MOUNTED: {
+            // This completes the latest mount on the same path
+            auto destination = normalise_path(r.path);
+            for (size_t i = tasks.size(); i-- > 0;) {
+                if (tasks[i].destination == destination) {
+                    fsids[i] = r.fsid;
+                    break;
+                }
+            }
+            break;
+        }
+        case mount_journal::record::ABANDONED: {
+            // This cancels the latest unfinished mount on the same path
+            auto destination = normalise_path(r.path);
+            for (size_t i = tasks.size(); i-- > 0;) {
+                if (tasks[i].destination == destination && !fsids[i]) {
+                    tasks.erase(tasks.begin() + i);
+                    fsids.erase(fsids.begin() + i);
+                    break;
+                }
+            }
+            break;
+        }
+        case mount_journal::record::DIRECTORY:
+        case mount_journal::record::FILE:
+            created.push_back(r.path);
+            break;
+        case mount_journal::record::SAVE:
+            saves.emplace_back(r.path, r.saved_path);
+            break;
+        }
+    }
+    for (size_t j = 0; j < tasks.size(); j++) {
+        for (size_t i = 0; i < j; i++) {
+            if (paths_overlap(tasks[i].destination, tasks[j].destination)) {
+                tasks[i].dependents.push_back(j);
+                tasks[j].dependencies.push_back(i);
+            }
+        }
+    }
+
+    std::exception_ptr eptr{nullptr};
+    try {
+        run_mount_tasks(tasks, true, false, [&](mount_task& task) {
+            auto& fsid = fsids[&task - tasks.data()];
+            if (!fsid) {
+                unmount_beneath(app, root_path, task.destination);
+                return;
+            }
+            auto id = "FSID:" + std::to_string((*fsid)[0]) + ":" +
+                      std::to_string((*fsid)[1]);
+            // The mount may already have been removed
+            if (::unmount(id.c_str(), MNT_BYFSID | MNT_FORCE) < 0 &&
+                errno != EINVAL && errno != ENOENT) {
+                throw std::system_error{
+                    errno,
+                    std::system_category(),
+                    "unmounting " + task.destination.native()};
+            }
+        });
+    } catch (const std::exception&) {
+        eptr = std::current_exception();
+    }
+    for (auto it = saves.rbegin(); it != saves.rend(); ++it) {
+        auto& [path, saved_path] = *it;
+        try {
+            if (fs::exists(saved_path)) {
+                fs::rename(saved_path, path);
+            }
+        } catch (const std::exception&) {
+            if (!eptr) {
+                eptr = std::current_exception();
+            }
+        }
+    }
+    remove_created(created, eptr);
+    if (eptr) {
+        std::rethrow_exception(eptr);
+    }
+    journal.clear();
+}
+
 void mount_volumes(main_app& app,
                    runtime_state& state,
                    const fs::path& root_path,
                    bool prepare_only,
-                   const json& mounts) {
-    bool file_mount_supported = true;
+                   const std::vector<oci_mount>& mounts) {
+    auto span = app.trace(prepare_only ? "mount_volumes (prepare)"
+                                       : "mount_volumes");
+    mount_journal journal{state.get_state_dir()};
+    journal.open();
+    mount_context ctx{app, state, root_path, prepare_only, journal};
+
+    // Use what earlier creates learned about file mounts so that we don't
+    // repeat a failing nmount for each container
+    std::optional<host_capabilities> caps;
+    if (!prepare_only) {
+        caps = host_capabilities::load(app);
+        if (caps->file_mounts) {
+            ctx.file_mount_supported = *caps->file_mounts;
+        }
+    }
+    auto record_capabilities = [&] {
+        if (caps && ctx.file_mount_probed) {
+            caps->record_file_mounts(app, ctx.file_mount_supported);
+        }
+    };
 
     try {
-        for (auto& mount : mounts) {
-            file_mount_supported = mount_volume(app,
-                                                file_mount_supported,
-                                                state,
-                                                root_path,
-                                                prepare_only,
-                                                mount);
+        std::vector<mount_task> tasks;
+        {
+            resolve_cache cache{app, root_path};
+            tasks = plan_mounts(app, root_path, mounts, true, &cache);
+            cache.save();
         }
+        run_mount_tasks(tasks, false, true, [&](mount_task& task) {
+            mount_volume(ctx,
+                         *task.mount,
+                         task_destination(app, root_path, task, false));
+        });
     } catch (const std::exception& e) {
         // Attempt to clean up in case we mounted something
+        record_capabilities();
+        state["file_mount_supported"] = ctx.file_mount_supported.load();
         try {
             unmount_volumes(app, state, root_path, mounts);
         } catch (...) {
         }
         throw;
     }
-    state["file_mount_supported"] = file_mount_supported;
+    record_capabilities();
+    state["file_mount_supported"] = ctx.file_mount_supported.load();
 }
 
 void unmount_volumes(main_app& app,
                      runtime_state& state,
                      const fs::path& root_path,
-                     const json& mounts) {
+                     const std::vector<oci_mount>& mounts) {
+    auto span = app.trace("unmount_volumes");
+    mount_journal journal{state.get_state_dir()};
+    if (journal.exists()) {
+        replay_journal(app, root_path, journal);
+        return;
+    }
+
+    // Containers created by older versions have no journal so we work out
+    // what to undo from the mounts and the runtime state.
+    if (mounts.empty()) {
+        return;
+    }
     bool file_mount_supported = state["file_mount_supported"];
 
     // Remember the first exception (if any) but try to unmount
-    // everything
+    // everything. Mounts are removed in the reverse of the order they were
+    // made in so that nested mounts go before their parents.
     std::exception_ptr eptr{nullptr};
-    for (auto& mount : mounts) {
-        try {
-            unmount_volume(app, file_mount_supported, state, root_path, mount);
-        } catch (const std::exception&) {
-            if (!eptr) {
-                eptr = std::current_exception();
-            }
-        }
-    }
     try {
-        // We need to remove subdirectories before parents. The ordering
-        // recorded in create_directories is not enough - if two mounts are made
-        // to the same parent directory (e.g. /data/foo, /data/bar), then the
-        // parent removal needs to happen after both subdirectories are removed.
-        //
-        // We sort the list in descending order since subdictories paths are
-        // lexically greater than parent paths.
-        std::vector<std::string> paths;
-        for (auto& dir : state["remove_on_unmount"]) {
-            paths.push_back(dir);
-        }
-        std::sort(paths.begin(), paths.end(), std::greater<std::string>());
-        for (auto& dir : paths) {
-            if (fs::exists(dir)) {
-                fs::remove(dir);
-            }
-        }
-    } catch (...) {
-        if (!eptr) {
-            eptr = std::current_exception();
-        }
+        // Mounts change what the destinations resolve to so the cache isn't
+        // used here.
+        auto tasks = plan_mounts(app, root_path, mounts, false, nullptr);
+        run_mount_tasks(tasks, true, false, [&](mount_task& task) {
+            // Don't hold the mounted directory open while unmounting it
+            auto destination = task_destination(app, root_path, task, true);
+            destination.close();
+            unmount_volume(app,
+                           file_mount_supported,
+                           state,
+                           root_path,
+                           *task.mount,
+                           destination.path);
+        });
+    } catch (const std::exception&) {
+        eptr = std::current_exception();
+    }
+
+    std::vector<std::string> created;
+    for (auto& path : state["remove_on_unmount"]) {
+        created.push_back(path.get<std::string>());
     }
+    remove_created(created, eptr);
     if (eptr) {
         std::rethrow_exception(eptr);
     }
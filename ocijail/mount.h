@@ -2,7 +2,7 @@
 
 #include <filesystem>
 
-#include "nlohmann/json.hpp"
+#include "ocijail/config.h"
 
 namespace ocijail {
 
@@ -16,11 +16,11 @@ void mount_volumes(main_app& app,
                    runtime_state& state,
                    const std::filesystem::path& root_path,
                    bool root_read_only,
-                   const nlohmann::json& mounts);
+                   const std::vector<oci_mount>& mounts);
 
 void unmount_volumes(main_app& app,
                      runtime_state& state,
                      const std::filesystem::path& root_path,
-                     const nlohmann::json& mounts);
+                     const std::vector<oci_mount>& mounts);
 
 }  // namespace ocijail
@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+#include "ocijail/mount_tasks.h"
+
+namespace fs = std::filesystem;
+
+namespace ocijail {
+
+fs::path normalise_path(const fs::path& path) {
+    auto res = path.lexically_normal();
+    if (!res.has_filename() && res.has_relative_path()) {
+        res = res.parent_path();
+    }
+    return res;
+}
+
+bool path_contains(const fs::path& parent, const fs::path& child) {
+    auto [ip, ic] = std::mismatch(
+        parent.begin(), parent.end(), child.begin(), child.end());
+    return ip == parent.end() && ic != child.end();
+}
+
+bool paths_overlap(const fs::path& a, const fs::path& b) {
+    return a == b || path_contains(a, b) || path_contains(b, a);
+}
+
+void link_mount_tasks(std::vector<mount_task>& tasks) {
+    for (size_t j = 0; j < tasks.size(); j++) {
+        auto& task = tasks[j];
+        for (size_t i = 0; i < j; i++) {
+            if (tasks[i].nullfs &&
+                path_contains(tasks[i].destination, task.destination)) {
+                task.barrier = true;
+            }
+        }
+        for (size_t i = 0; i < j; i++) {
+            auto& earlier = tasks[i];
+            if (task.barrier || earlier.barrier ||
+                paths_overlap(earlier.destination, task.destination) ||
+                paths_overlap(earlier.resolved.path, task.resolved.path)) {
+                earlier.dependents.push_back(j);
+                task.dependencies.push_back(i);
+            }
+        }
+    }
+}
+
+void run_workers(size_t jobs, const std::function<void()>& worker) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < jobs; i++) {
+        try {
+            threads.emplace_back(worker);
+        } catch (const std::system_error&) {
+            // Carry on with the threads we have
+            break;
+        }
+    }
+    worker();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+void run_mount_tasks(std::vector<mount_task>& tasks,
+                     bool reverse,
+                     bool stop_on_error,
+                     const std::function<void(mount_task&)>& fn) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<size_t> ready;
+    size_t running = 0;
+    bool stopped = false;
+    std::exception_ptr error;
+    for (size_t i = 0; i < tasks.size(); i++) {
+        auto& task = tasks[i];
+        task.waiting =
+            reverse ? task.dependents.size() : task.dependencies.size();
+        if (task.waiting == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    auto worker = [&] {
+        std::unique_lock lk{mutex};
+        for (;;) {
+            cv.wait(lk, [&] {
+                return stopped || !ready.empty() || running == 0;
+            });
+            if (stopped || ready.empty()) {
+                break;
+            }
+            auto i = ready.front();
+            ready.pop_front();
+            running++;
+            lk.unlock();
+
+            std::exception_ptr e;
+            try {
+                fn(tasks[i]);
+            } catch (...) {
+                e = std::current_exception();
+            }
+
+            lk.lock();
+            running--;
+            if (e && !error) {
+                error = e;
+            }
+            if (e && stop_on_error) {
+                stopped = true;
+            } else {
+                auto& next = reverse ? tasks[i].dependencies
+                                     : tasks[i].dependents;
+                for (auto d : next) {
+                    if (--tasks[d].waiting == 0) {
+                        ready.push_back(d);
+                    }
+                }
+            }
+            cv.notify_all();
+        }
+    };
+
+    run_workers(std::min(max_mount_jobs, tasks.size()), worker);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+}  // namespace ocijail
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <unistd.h>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace ocijail {
+
+struct oci_mount;
+
+// The most threads used for mounting, unmounting, removing directories or
+// copying files
+constexpr size_t max_mount_jobs = 8;
+
+// Normalise a path for comparison, including removing any trailing slash
+std::filesystem::path normalise_path(const std::filesystem::path& path);
+
+// True if child is inside parent, but not the same path
+bool path_contains(const std::filesystem::path& parent,
+                   const std::filesystem::path& child);
+
+// True if a and b are the same path or one contains the other
+bool paths_overlap(const std::filesystem::path& a,
+                   const std::filesystem::path& b);
+
+// A path inside a container root, as resolved by resolve_container_path
+struct container_path {
+    container_path() = default;
+    container_path(const container_path&) = delete;
+    container_path(container_path&& other) noexcept
+        : path(std::move(other.path)), fd(std::exchange(other.fd, -1)) {}
+    container_path& operator=(container_path&& other) noexcept {
+        close();
+        path = std::move(other.path);
+        fd = std::exchange(other.fd, -1);
+        return *this;
+    }
+    ~container_path() { close(); }
+
+    void close() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    std::filesystem::path path;
+    // An open descriptor for path if it is an existing directory, otherwise
+    // -1. This keeps the directory which was checked when creating the mount
+    // point, but nmount still looks up path, which may since have been
+    // changed to lead somewhere else. check_mount_point compares the two
+    // just before mounting.
+    int fd = -1;
+};
+
+// A node in the graph of mounts. A mount depends on each earlier mount which
+// overlaps it, i.e. where either destination is the same as or contains the
+// other, either as written or after resolving symbolic links in the root. A
+// mount nested under a nullfs mount may follow symbolic links from outside
+// the root so it is ordered with respect to all other mounts.
+struct mount_task {
+    const oci_mount* mount;
+    std::filesystem::path destination;
+    // The destination resolved when the graph was built, with an empty path
+    // if that failed. This is only used as-is by tasks which don't wait for
+    // others.
+    container_path resolved;
+    // Set for nullfs mounts, whose contents may change what the
+    // destinations of later mounts nested under them resolve to
+    bool nullfs = false;
+    bool barrier = false;
+    std::vector<size_t> dependencies;
+    std::vector<size_t> dependents;
+    size_t waiting = 0;
+};
+
+// Add the dependencies between tasks whose destination, resolved path,
+// nullfs and barrier fields are set, as described for mount_task. A task
+// which is already a barrier, e.g. because its destination couldn't be
+// resolved, is ordered with respect to all other tasks.
+void link_mount_tasks(std::vector<mount_task>& tasks);
+
+// Run worker on up to jobs threads, including this one
+void run_workers(size_t jobs, const std::function<void()>& worker);
+
+// Call fn for each task on up to max_mount_jobs threads. Each task starts
+// when the tasks it depends on are complete or, if reverse is true, when the
+// tasks which depend on it are complete. The first error is rethrown once
+// all running tasks have finished. If stop_on_error is true, no more tasks
+// are started after an error, otherwise a failed task counts as complete.
+// fn makes or removes the mounts themselves, so the scheduling can be tested
+// with a fake.
+void run_mount_tasks(std::vector<mount_task>& tasks,
+                     bool reverse,
+                     bool stop_on_error,
+                     const std::function<void(mount_task&)>& fn);
+
+}  // namespace ocijail
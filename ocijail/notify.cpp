@@ -0,0 +1,233 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+#if defined(__FreeBSD__)
+#include <sys/event.h>
+#else
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#endif
+
+#include "ocijail/notify.h"
+
+namespace ocijail {
+
+#if defined(__FreeBSD__)
+
+notifier::notifier() {
+    fd_ = ::kqueue();
+    if (fd_ < 0) {
+        throw std::system_error{errno, std::system_category(), "kqueue"};
+    }
+}
+
+notifier::~notifier() {
+    for (auto [id, fd] : paths_) {
+        ::close(fd);
+    }
+    ::close(fd_);
+}
+
+bool notifier::watch_process(pid_t pid) {
+    struct kevent kev;
+    EV_SET(&kev, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, nullptr);
+    if (::kevent(fd_, &kev, 1, nullptr, 0, nullptr) < 0) {
+        if (errno == ESRCH) {
+            return false;
+        }
+        throw std::system_error{
+            errno, std::system_category(), "watching process exit"};
+    }
+    return true;
+}
+
+int notifier::watch_path(const std::filesystem::path& path) {
+    auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "open " + path.native()};
+    }
+    auto id = next_id_++;
+    struct kevent kev;
+    EV_SET(&kev,
+           fd,
+           EVFILT_VNODE,
+           EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME,
+           0,
+           reinterpret_cast<void*>(static_cast<intptr_t>(id)));
+    if (::kevent(fd_, &kev, 1, nullptr, 0, nullptr) < 0) {
+        auto saved_errno = errno;
+        ::close(fd);
+        throw std::system_error{
+            saved_errno, std::system_category(), "watching " + path.native()};
+    }
+    paths_[id] = fd;
+    return id;
+}
+
+void notifier::unwatch_path(int id) {
+    // Closing the descriptor removes its events from the kqueue
+    auto it = paths_.find(id);
+    if (it != paths_.end()) {
+        ::close(it->second);
+        paths_.erase(it);
+    }
+}
+
+std::optional<notifier::event> notifier::wait(
+    std::optional<std::chrono::milliseconds> timeout) {
+    ::timespec ts;
+    if (timeout) {
+        ts.tv_sec = timeout->count() / 1000;
+        ts.tv_nsec = (timeout->count() % 1000) * 1000000;
+    }
+    struct kevent kev;
+    for (;;) {
+        auto n = ::kevent(fd_, nullptr, 0, &kev, 1, timeout ? &ts : nullptr);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error{errno, std::system_category(), "kevent"};
+        }
+        if (n == 0) {
+            return std::nullopt;
+        }
+        if (kev.filter == EVFILT_PROC) {
+            return event{event::PROCESS_EXIT,
+                         static_cast<int>(kev.ident),
+                         static_cast<int>(kev.data)};
+        }
+        if (kev.filter == EVFILT_VNODE) {
+            return event{
+                event::PATH_CHANGED,
+                static_cast<int>(reinterpret_cast<intptr_t>(kev.udata))};
+        }
+    }
+}
+
+#else
+
+notifier::notifier() {
+    fd_ = ::inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd_ < 0) {
+        throw std::system_error{errno, std::system_category(), "inotify_init"};
+    }
+}
+
+notifier::~notifier() {
+    for (auto [pid, fd] : processes_) {
+        ::close(fd);
+    }
+    ::close(fd_);
+}
+
+bool notifier::watch_process(pid_t pid) {
+    auto fd = ::syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0) {
+        if (errno == ESRCH) {
+            return false;
+        }
+        throw std::system_error{errno, std::system_category(), "pidfd_open"};
+    }
+    processes_[pid] = fd;
+    return true;
+}
+
+int notifier::watch_path(const std::filesystem::path& path) {
+    auto wd = ::inotify_add_watch(fd_,
+                                  path.c_str(),
+                                  IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE |
+                                      IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                      IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "watching " + path.native()};
+    }
+    auto id = next_id_++;
+    paths_[id] = wd;
+    return id;
+}
+
+void notifier::unwatch_path(int id) {
+    auto it = paths_.find(id);
+    if (it != paths_.end()) {
+        ::inotify_rm_watch(fd_, it->second);
+        paths_.erase(it);
+    }
+}
+
+std::optional<notifier::event> notifier::wait(
+    std::optional<std::chrono::milliseconds> timeout) {
+    while (pending_.empty()) {
+        std::vector<pollfd> fds;
+        fds.push_back(pollfd{fd_, POLLIN, 0});
+        for (auto [pid, fd] : processes_) {
+            fds.push_back(pollfd{fd, POLLIN, 0});
+        }
+        auto n = ::poll(&fds[0], fds.size(), timeout ? timeout->count() : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error{errno, std::system_category(), "poll"};
+        }
+        if (n == 0) {
+            return std::nullopt;
+        }
+
+        // Exited processes. The exit status is only available for our own
+        // children.
+        for (auto it = processes_.begin(); it != processes_.end();) {
+            auto [pid, fd] = *it;
+            auto pfd = std::find_if(fds.begin(), fds.end(), [fd](auto& p) {
+                return p.fd == fd;
+            });
+            if (pfd->revents == 0) {
+                ++it;
+                continue;
+            }
+            int status = -1;
+            ::siginfo_t info{};
+            if (::waitid(static_cast<idtype_t>(P_PIDFD),
+                         fd,
+                         &info,
+                         WEXITED | WNOHANG) == 0 &&
+                info.si_pid == pid) {
+                status = info.si_code == CLD_EXITED ? info.si_status << 8
+                                                    : info.si_status;
+            }
+            pending_.push_back(event{event::PROCESS_EXIT, pid, status});
+            ::close(fd);
+            it = processes_.erase(it);
+        }
+
+        // Changed paths
+        if (fds[0].revents) {
+            alignas(inotify_event) char buf[4096];
+            auto len = ::read(fd_, buf, sizeof(buf));
+            for (char* p = buf; len > 0 && p < buf + len;) {
+                auto ev = reinterpret_cast<inotify_event*>(p);
+                for (auto [id, wd] : paths_) {
+                    if (wd == ev->wd) {
+                        pending_.push_back(event{event::PATH_CHANGED, id});
+                    }
+                }
+                p += sizeof(inotify_event) + ev->len;
+            }
+        }
+    }
+    auto ev = pending_.front();
+    pending_.erase(pending_.begin());
+    return ev;
+}
+
+#endif
+
+}  // namespace ocijail
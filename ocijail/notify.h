@@ -0,0 +1,59 @@
+#pragma once
+
+#include <sys/types.h>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <vector>
+
+namespace ocijail {
+
+// Wait for processes to exit and for files or directories to change. On
+// FreeBSD this is a thin wrapper over kqueue using EVFILT_PROC and
+// EVFILT_VNODE. Elsewhere it uses pidfd and inotify so that code built on it
+// can be exercised on Linux.
+class notifier {
+   public:
+    struct event {
+        enum kind_t {
+            PROCESS_EXIT,
+            PATH_CHANGED,
+        };
+        kind_t kind;
+        // The pid for PROCESS_EXIT or the watch id for PATH_CHANGED
+        int ident;
+        // For PROCESS_EXIT, the wait status if known, otherwise -1
+        int status{-1};
+    };
+
+    notifier();
+    notifier(const notifier&) = delete;
+    ~notifier();
+
+    // Watch for the exit of a process. Returns false if the process does not
+    // exist, e.g. because it has already exited.
+    bool watch_process(pid_t pid);
+
+    // Watch a file or directory for writes, renames and deletion. Changes to
+    // a directory include entries being added, removed or renamed. Returns
+    // an id which identifies the path in events.
+    int watch_path(const std::filesystem::path& path);
+    void unwatch_path(int id);
+
+    // Wait for the next event. Returns std::nullopt if the timeout expires
+    // before anything happens.
+    std::optional<event> wait(
+        std::optional<std::chrono::milliseconds> timeout = std::nullopt);
+
+   private:
+    int fd_;
+    int next_id_{0};
+    // Open descriptors for each watch: vnode descriptors for kqueue, pidfds
+    // and inotify watch descriptors elsewhere.
+    std::map<int, int> paths_;
+    std::map<pid_t, int> processes_;
+    std::vector<event> pending_;
+};
+
+}  // namespace ocijail
@@ -0,0 +1,334 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <system_error>
+#include <type_traits>
+
+#include "ocijail/plan.h"
+
+namespace fs = std::filesystem;
+
+namespace ocijail {
+
+namespace {
+
+constexpr char MAGIC[4] = {'o', 'c', 'p', 'l'};
+constexpr uint32_t VERSION = 1;
+
+// The number of plans and markers kept in the state database. When there
+// are more, the least recently used are removed until half are left so that
+// the state database is only scanned once for every MAX_PLANS / 2 new
+// configs.
+constexpr size_t MAX_PLANS = 64;
+
+// The fields of each config struct, in encoding order. Bump VERSION when
+// changing any of these.
+template <typename Archive>
+void fields(Archive& ar, oci_user& user) {
+    ar(user.uid, user.gid, user.umask, user.additional_gids);
+}
+
+template <typename Archive>
+void fields(Archive& ar, oci_process& process) {
+    ar(process.terminal, process.cwd, process.args, process.env, process.user);
+}
+
+template <typename Archive>
+void fields(Archive& ar, oci_root& root) {
+    ar(root.path, root.readonly);
+}
+
+template <typename Archive>
+void fields(Archive& ar, oci_mount& mount) {
+    ar(mount.destination, mount.source, mount.type, mount.options);
+}
+
+template <typename Archive>
+void fields(Archive& ar, oci_hook& hook) {
+    ar(hook.path, hook.args, hook.env, hook.timeout);
+}
+
+template <typename Archive>
+void fields(Archive& ar, oci_hooks& hooks) {
+    ar(hooks.prestart,
+       hooks.create_runtime,
+       hooks.create_container,
+       hooks.start_container,
+       hooks.poststart,
+       hooks.poststop);
+}
+
+template <typename Archive>
+void fields(Archive& ar, oci_config& config) {
+    ar(config.oci_version,
+       config.process,
+       config.root,
+       config.hostname,
+       config.mounts,
+       config.hooks,
+       config.annotations);
+}
+
+template <typename T>
+struct is_map : std::false_type {};
+template <typename K, typename V, typename C>
+struct is_map<std::map<K, V, C>> : std::true_type {};
+
+class plan_writer {
+   public:
+    template <typename... Ts>
+    void operator()(const Ts&... values) {
+        (put(values), ...);
+    }
+
+    template <typename T>
+    void put(const T& value) {
+        if constexpr (std::is_arithmetic_v<T>) {
+            buf_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        } else if constexpr (std::is_same_v<T, std::string>) {
+            put(uint32_t(value.size()));
+            buf_.append(value);
+        } else if constexpr (std::is_same_v<T, fs::path>) {
+            put(value.native());
+        } else if constexpr (requires { value.has_value(); }) {
+            put(value.has_value());
+            if (value) {
+                put(*value);
+            }
+        } else if constexpr (is_map<T>::value) {
+            put(uint32_t(value.size()));
+            for (auto& [k, v] : value) {
+                put(k);
+                put(v);
+            }
+        } else if constexpr (requires { value.begin(); }) {
+            put(uint32_t(value.size()));
+            for (auto& v : value) {
+                put(v);
+            }
+        } else {
+            // The archive only reads from the struct
+            fields(*this, const_cast<T&>(value));
+        }
+    }
+
+    void raw(std::string_view bytes) { buf_.append(bytes); }
+
+    const std::string& buf() const { return buf_; }
+
+   private:
+    std::string buf_;
+};
+
+class plan_reader {
+   public:
+    explicit plan_reader(std::string_view buf) : buf_(buf) {}
+
+    template <typename... Ts>
+    void operator()(Ts&... values) {
+        (get(values), ...);
+    }
+
+    template <typename T>
+    void get(T& value) {
+        if constexpr (std::is_arithmetic_v<T>) {
+            std::memcpy(&value, take(sizeof(value)).data(), sizeof(value));
+        } else if constexpr (std::is_same_v<T, std::string>) {
+            uint32_t size;
+            get(size);
+            value = take(size);
+        } else if constexpr (std::is_same_v<T, fs::path>) {
+            std::string s;
+            get(s);
+            value = std::move(s);
+        } else if constexpr (requires { value.has_value(); }) {
+            bool present;
+            get(present);
+            if (present) {
+                get(value.emplace());
+            } else {
+                value.reset();
+            }
+        } else if constexpr (is_map<T>::value) {
+            uint32_t size;
+            get(size);
+            for (uint32_t i = 0; i < size; i++) {
+                typename T::key_type k;
+                typename T::mapped_type v;
+                get(k);
+                get(v);
+                value.emplace(std::move(k), std::move(v));
+            }
+        } else if constexpr (requires { value.begin(); }) {
+            uint32_t size;
+            get(size);
+            value.clear();
+            for (uint32_t i = 0; i < size; i++) {
+                get(value.emplace_back());
+            }
+        } else {
+            fields(*this, value);
+        }
+    }
+
+    std::string_view take(size_t n) {
+        if (n > buf_.size()) {
+            throw std::runtime_error("truncated plan");
+        }
+        auto res = buf_.substr(0, n);
+        buf_.remove_prefix(n);
+        return res;
+    }
+
+   private:
+    std::string_view buf_;
+};
+
+// FNV-1a, which is only used to pick a file name. Plans are checked against
+// the full config text before use.
+uint64_t hash_text(std::string_view text) {
+    uint64_t h = 0xcbf29ce484222325;
+    for (auto ch : text) {
+        h ^= uint8_t(ch);
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+}  // namespace
+
+bundle_plan::bundle_plan(const fs::path& state_db, std::string_view text)
+    : text_(text), state_db_(state_db) {
+    char name[32];
+    ::snprintf(name,
+               sizeof(name),
+               ".plan-%016llx",
+               static_cast<unsigned long long>(hash_text(text)));
+    path_ = state_db / name;
+}
+
+std::optional<oci_config> bundle_plan::load() const {
+    if (!fs::is_regular_file(path_)) {
+        return std::nullopt;
+    }
+    mapped_file file{path_};
+    if (file.contents().empty()) {
+        // Only a marker for a config which has been seen once
+        return std::nullopt;
+    }
+    plan_reader reader{file.contents()};
+    try {
+        if (reader.take(sizeof(MAGIC)) != std::string_view{MAGIC, 4}) {
+            return std::nullopt;
+        }
+        uint32_t version;
+        uint64_t size;
+        reader(version, size);
+        if (version != VERSION || size != text_.size() ||
+            reader.take(size) != text_) {
+            return std::nullopt;
+        }
+        oci_config config;
+        reader.get(config);
+        // The modification time of a plan records when it was last used
+        ::utimensat(AT_FDCWD, path_.c_str(), nullptr, 0);
+        return config;
+    } catch (const std::runtime_error&) {
+        // A truncated or otherwise damaged plan is replaced by the caller
+        return std::nullopt;
+    }
+}
+
+void bundle_plan::store(const oci_config& config) const {
+    // Most configs are only used once, e.g. podman writes one for each
+    // container, so the first time we only leave an empty marker.
+    if (!fs::exists(path_)) {
+        std::ofstream{path_};
+        if (count_added() >= MAX_PLANS / 2) {
+            evict();
+        }
+        return;
+    }
+
+    plan_writer writer;
+    writer(MAGIC[0], MAGIC[1], MAGIC[2], MAGIC[3]);
+    writer(VERSION, uint64_t(text_.size()));
+    writer.raw(text_);
+    writer(config);
+
+    // Write a private file and rename it so that readers only ever see a
+    // complete plan.
+    auto tmp = path_;
+    tmp += "." + std::to_string(::getpid());
+    {
+        std::ofstream out{tmp, std::ios::binary};
+        out.write(writer.buf().data(), writer.buf().size());
+        if (!out) {
+            throw std::runtime_error("writing " + tmp.native());
+        }
+    }
+    fs::rename(tmp, path_);
+}
+
+size_t bundle_plan::count_added() const {
+    auto path = added_path();
+    auto fd = ::open(
+        path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "opening " + path.native()};
+    }
+    struct stat st;
+    auto ok = ::write(fd, "+", 1) == 1 && ::fstat(fd, &st) == 0;
+    auto err = errno;
+    ::close(fd);
+    if (!ok) {
+        throw std::system_error{
+            err, std::system_category(), "writing " + path.native()};
+    }
+    return st.st_size;
+}
+
+void bundle_plan::evict() const {
+    // Start counting again before the scan so that markers added while we
+    // scan are counted towards the next one
+    if (::truncate(added_path().c_str(), 0) < 0 && errno != ENOENT) {
+        throw std::system_error{errno,
+                                std::system_category(),
+                                "truncating " + added_path().native()};
+    }
+
+    struct plan_file {
+        fs::path path;
+        fs::file_time_type used;
+    };
+    std::vector<plan_file> plans;
+    for (auto& entry : fs::directory_iterator{state_db_}) {
+        auto name = entry.path().filename().native();
+        // Skip files which are still being written
+        if (!name.starts_with(".plan-") || name.find('.', 1) != name.npos) {
+            continue;
+        }
+        std::error_code ec;
+        auto used = entry.last_write_time(ec);
+        if (!ec) {
+            plans.push_back({entry.path(), used});
+        }
+    }
+    if (plans.size() <= MAX_PLANS / 2) {
+        return;
+    }
+    std::sort(plans.begin(), plans.end(), [](auto& a, auto& b) {
+        return a.used < b.used;
+    });
+    for (size_t i = 0; i < plans.size() - MAX_PLANS / 2; i++) {
+        std::error_code ec;
+        fs::remove(plans[i].path, ec);
+    }
+}
+
+}  // namespace ocijail
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string_view>
+
+#include "ocijail/config.h"
+
+namespace ocijail {
+
+// A validated bundle config, cached in the state database so that creating
+// many containers from the same bundle only parses and validates its config
+// once. Plans are keyed by a hash of the config.json text and each one holds
+// a copy of that text, which is compared before a plan is used, followed by
+// the typed config in a compact binary encoding.
+//
+// The first time a config is seen only an empty marker is saved and a plan
+// is saved when it is seen again. New markers are counted in .plans-added
+// and, once enough have been added, the least recently used plans and
+// markers are removed so that there are never more than a fixed number.
+class bundle_plan {
+   public:
+    bundle_plan(const std::filesystem::path& state_db, std::string_view text);
+
+    // Return the cached config, if there is a plan for this text
+    std::optional<oci_config> load() const;
+
+    // Save a plan (or a marker) for a config which was parsed from this text
+    // and validated, and remove old plans if necessary
+    void store(const oci_config& config) const;
+
+   private:
+    // Count a new marker, returning the number added since the last
+    // eviction. Each one appends a byte to .plans-added so that concurrent
+    // creates don't need a lock.
+    size_t count_added() const;
+    void evict() const;
+
+    std::filesystem::path added_path() const {
+        return state_db_ / ".plans-added";
+    }
+
+    std::string_view text_;
+    std::filesystem::path state_db_;
+    std::filesystem::path path_;
+};
+
+}  // namespace ocijail
@@ -16,103 +16,25 @@ using nlohmann::json;
 
 namespace ocijail {
 
-process::process(const json& process_json,
+process::process(const oci_process& config,
                  std::optional<std::filesystem::path> console_socket,
                  bool detach,
                  int preserve_fds)
     : console_socket_(console_socket),
       detach_(detach),
-      preserve_fds_(preserve_fds) {
-    if (!process_json.is_object()) {
-        malformed_config("process must be an object");
-    }
-
-    if (!process_json.contains("cwd")) {
-        malformed_config("no process.cwd");
-    }
-    auto& process_json_cwd = process_json["cwd"];
-    if (!process_json_cwd.is_string()) {
-        malformed_config("process.cwd must be a string");
-    }
-    cwd_ = process_json_cwd;
-
-    if (!process_json.contains("args")) {
-        malformed_config("no process.args");
-    }
-    auto& config_args = process_json["args"];
-    if (!config_args.is_array()) {
-        malformed_config("process.args must be an array");
-    }
-    if (config_args.size() == 0) {
-        malformed_config("process.args must have at least one element");
-    }
-    for (auto& arg : config_args) {
-        if (!arg.is_string()) {
-            malformed_config("process.args must be an array of strings");
-        }
-        args_.push_back(arg.get<std::string>());
-    }
-
-    if (process_json.contains("user")) {
-        auto user = process_json["user"];
-        if (!user.is_null()) {
-            if (!user.is_object()) {
-                malformed_config("process.user must be an object");
-            }
-            if (!user["uid"].is_number()) {
-                malformed_config("process.user.uid must be a number");
-            }
-            uid_ = user["uid"];
-            if (!user["gid"].is_number()) {
-                malformed_config("process.user.gid must be a number");
-            }
-            gid_ = user["gid"];
-            if (user.contains("umask") && !user["umask"].is_number()) {
-                malformed_config("process.user.umask must be a number");
-                umask_ = user["umask"];
-            }
-            gids_.push_back(gid_);
-            if (user.contains("additionalGids")) {
-                auto gids = user["additionalGids"];
-                if (!gids.is_array()) {
-                    malformed_config(
-                        "process.user.additionalGids must be an array");
-                }
-                for (auto& gid : gids) {
-                    if (!gid.is_number()) {
-                        malformed_config(
-                            "process.user.additionalGids must be an array of "
-                            "numbers");
-                    }
-                    gids_.push_back(gid);
-                }
-            }
-        }
-    } else {
-        uid_ = 0;
-        gid_ = 0;
-        gids_.push_back(0);
-    }
+      preserve_fds_(preserve_fds),
+      cwd_(config.cwd),
+      args_(config.args),
+      env_(config.env),
+      uid_(config.user.uid),
+      gid_(config.user.gid),
+      umask_(config.user.umask.value_or(077)),
+      terminal_(config.terminal) {
+    gids_.push_back(gid_);
+    gids_.insert(gids_.end(),
+                 config.user.additional_gids.begin(),
+                 config.user.additional_gids.end());
 
-    if (process_json.contains("env")) {
-        auto& config_env = process_json["env"];
-        if (!config_env.is_array()) {
-            malformed_config("process.env must be an array");
-        }
-        for (auto& arg : config_env) {
-            if (!arg.is_string()) {
-                malformed_config("process.env must be an array of strings");
-            }
-            env_.push_back(arg.get<std::string>());
-        }
-    }
-
-    if (process_json.contains("terminal")) {
-        if (!process_json["terminal"].is_boolean()) {
-            malformed_config("process.terminal must be a boolean");
-        }
-        terminal_ = process_json["terminal"];
-    }
     if (terminal_) {
         if (detach_) {
             if (!console_socket_) {
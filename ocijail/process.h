@@ -1,15 +1,14 @@
 #pragma once
 
-#include "nlohmann/json.hpp"
-
+#include "ocijail/config.h"
 #include "ocijail/main.h"
 
 namespace ocijail {
 
 struct process {
-    // initialise with a json from either create or exec - this will
-    // validate the input, throwing an error if necessary.
-    process(const nlohmann::json& process,
+    // initialise with a process config from either create or exec - this
+    // will validate the console socket, throwing an error if necessary.
+    process(const oci_process& config,
             std::optional<std::filesystem::path> console_socket,
             bool detach,
             int preserve_fds);
@@ -36,7 +35,7 @@ struct process {
     bool detach_;
     int preserve_fds_;
 
-    // Copied out from the json during parsing
+    // Copied out from the config
     std::string cwd_;
     std::vector<std::string> args_;
     std::vector<std::string> env_;
@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <cstdint>
+
+#include "ocijail/main.h"
+#include "ocijail/schema.h"
+
+using nlohmann::json;
+
+namespace ocijail {
+
+static bool has_type(const json& value, json_type type) {
+    switch (type) {
+    case json_type::STRING:
+        return value.is_string();
+    case json_type::NUMBER:
+        return value.is_number();
+    case json_type::BOOLEAN:
+        return value.is_boolean();
+    case json_type::OBJECT:
+        return value.is_object();
+    case json_type::ARRAY:
+        return value.is_array();
+    }
+    return false;
+}
+
+void validate(const json& value, const schema& s) {
+    if (!has_type(value, s.type)) {
+        malformed_config(s.type_error);
+    }
+    if (value.is_array()) {
+        if (s.values) {
+            for (auto& item : value) {
+                validate(item, *s.values);
+            }
+        }
+        if (value.size() < s.min_items) {
+            malformed_config(s.min_items_error);
+        }
+    } else if (value.is_object()) {
+        uint64_t seen = 0;
+        for (auto it = value.begin(); it != value.end(); ++it) {
+            auto& key = it.key();
+            auto field = std::find_if(
+                s.fields.begin(), s.fields.end(), [&](auto& f) {
+                    return f.name == key;
+                });
+            if (field != s.fields.end()) {
+                if (it->is_null() && field->value->nullable) {
+                    continue;
+                }
+                seen |= uint64_t(1) << (field - s.fields.begin());
+                validate(*it, *field->value);
+            } else if (s.values) {
+                validate(*it, *s.values);
+            }
+        }
+        for (size_t i = 0; i < s.fields.size(); i++) {
+            if (s.fields[i].missing_error && !(seen & (uint64_t(1) << i))) {
+                malformed_config(s.fields[i].missing_error);
+            }
+        }
+    }
+}
+
+}  // namespace ocijail
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+#include "nlohmann/json.hpp"
+
+namespace ocijail {
+
+// A small subset of json schema, used to describe the parts of the OCI
+// runtime configuration which we use as constexpr tables. A document is
+// checked against a schema in a single walk which doesn't allocate unless
+// it fails, in which case malformed_config is called with the message from
+// the first rule broken.
+
+enum class json_type { STRING, NUMBER, BOOLEAN, OBJECT, ARRAY };
+
+struct schema_field;
+
+struct schema {
+    json_type type;
+    const char* type_error;
+    // If true, a null value is accepted and treated as if it was absent
+    bool nullable = false;
+    // The known fields of an object. Other fields are ignored unless values
+    // is set.
+    std::span<const schema_field> fields = {};
+    // The schema for array elements or, for objects, for the values of
+    // fields which are not listed in fields
+    const schema* values = nullptr;
+    size_t min_items = 0;
+    const char* min_items_error = nullptr;
+};
+
+struct schema_field {
+    std::string_view name;
+    const schema* value;
+    // If set, the field is required and this is the message used when it is
+    // missing
+    const char* missing_error = nullptr;
+};
+
+// Required fields are tracked with a bit mask so field lists are limited in
+// size. Use this to check the limit when defining a schema.
+constexpr size_t max_schema_fields = 64;
+
+template <size_t N>
+constexpr std::span<const schema_field> schema_fields(
+    const schema_field (&fields)[N]) {
+    static_assert(N <= max_schema_fields);
+    return fields;
+}
+
+void validate(const nlohmann::json& value, const schema& s);
+
+}  // namespace ocijail
@@ -0,0 +1,338 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <set>
+
+#include "nlohmann/json.hpp"
+
+#include "ocijail/serve.h"
+
+namespace fs = std::filesystem;
+
+using nlohmann::json;
+
+namespace {
+
+// Largest request or reply we accept
+constexpr size_t max_message_size = 65536;
+
+// Commands which are safe to run in the daemon on behalf of the CLI. Commands
+// which start container processes (create and exec) are not forwarded since
+// the caller expects to be able to reap those processes.
+const std::set<std::string_view> forwarded_commands{
+    "delete",
+    "features",
+    "kill",
+    "list",
+    "metrics",
+    "start",
+    "state",
+};
+
+// Global options which take a value
+const std::set<std::string_view> value_options{
+    "--log",
+    "--log-format",
+    "--log-level",
+    "--root",
+};
+
+// The socket path may be too long to fit into sockaddr_un - open the parent
+// directory and use the filename relative to that, like
+// send_pty_control_fd.
+std::tuple<int, sockaddr_un> socket_address(const fs::path& path) {
+    auto dir = path.parent_path();
+    auto name = path.filename();
+    auto dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (dir_fd < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "open " + dir.native()};
+    }
+    sockaddr_un sun;
+    sun.sun_len = name.native().size() + 1;
+    sun.sun_family = AF_UNIX;
+    ::strlcpy(sun.sun_path, name.c_str(), SUNPATHLEN);
+    return {dir_fd, sun};
+}
+
+}  // namespace
+
+namespace ocijail {
+
+void serve::init(main_app& app) {
+    static serve instance{app};
+}
+
+serve::serve(main_app& app) : app_(app) {
+    auto sub = app.add_subcommand(
+        "serve",
+        "Run a daemon which executes commands forwarded to it over a local "
+        "socket");
+    sub->add_option("--socket",
+                    socket_,
+                    "Path for the daemon socket (default: .serve.sock in the "
+                    "state database)");
+    sub->final_callback([this] { run(); });
+}
+
+std::optional<int> serve::forward(int argc, char** argv) {
+    // Find the state database and the subcommand without setting up the
+    // whole command line parser. Anything unusual is left to main_app.
+    fs::path state_db{main_app::default_state_db};
+    std::optional<std::string_view> command;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg{argv[i]};
+        if (!arg.starts_with("-")) {
+            command = arg;
+            break;
+        }
+        if (arg.starts_with("--root=")) {
+            state_db = arg.substr(7);
+        } else if (value_options.contains(arg)) {
+            if (i + 1 >= argc) {
+                return std::nullopt;
+            }
+            if (arg == "--root") {
+                state_db = argv[i + 1];
+            }
+            i++;
+        } else if (arg.starts_with("--log")) {
+            // --log=..., --log-format=... or --log-level=...
+        } else {
+            // --testing, --version, --help etc. are handled locally
+            return std::nullopt;
+        }
+    }
+    if (!command || !forwarded_commands.contains(*command)) {
+        return std::nullopt;
+    }
+
+    auto path = socket_path(state_db);
+    if (!fs::is_socket(path)) {
+        return std::nullopt;
+    }
+    auto sock_fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0) {
+        throw std::system_error{errno, std::system_category(), "socket"};
+    }
+    auto [dir_fd, sun] = socket_address(path);
+    auto res = ::connectat(
+        dir_fd, sock_fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun));
+    ::close(dir_fd);
+    if (res < 0) {
+        // A stale socket from a daemon which is no longer running - just run
+        // the command ourselves.
+        ::close(sock_fd);
+        return std::nullopt;
+    }
+
+    json request;
+    request["args"] = std::vector<std::string>(argv + 1, argv + argc);
+    request["cwd"] = fs::current_path();
+    auto s = request.dump();
+    if (s.size() > max_message_size) {
+        ::close(sock_fd);
+        return std::nullopt;
+    }
+
+    // Send the request with our stdin, stdout and stderr attached
+    ::iovec iov{.iov_base = s.data(), .iov_len = s.size()};
+    std::array<char, CMSG_SPACE(3 * sizeof(int))> cmsg;
+    std::fill_n(cmsg.begin(), cmsg.size(), 0);
+    ::msghdr hdr{
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsg.data(),
+        .msg_controllen = cmsg.size(),
+    };
+    auto m = CMSG_FIRSTHDR(&hdr);
+    *m = cmsghdr{
+        .cmsg_len = CMSG_LEN(3 * sizeof(int)),
+        .cmsg_level = SOL_SOCKET,
+        .cmsg_type = SCM_RIGHTS,
+    };
+    auto fds = reinterpret_cast<int*>(CMSG_DATA(m));
+    fds[0] = 0;
+    fds[1] = 1;
+    fds[2] = 2;
+    if (::sendmsg(sock_fd, &hdr, 0) < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "sending request to daemon"};
+    }
+
+    std::array<char, max_message_size> buf;
+    auto n = ::recv(sock_fd, buf.data(), buf.size(), 0);
+    if (n < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "reading reply from daemon"};
+    }
+    ::close(sock_fd);
+    if (n == 0) {
+        throw std::runtime_error{"daemon closed connection without replying"};
+    }
+    auto reply = json::parse(buf.data(), buf.data() + n);
+    return reply["status"].get<int>();
+}
+
+void serve::run() {
+    auto path = socket_.value_or(socket_path(app_.get_state_db()));
+    fs::create_directories(path.parent_path());
+    fs::remove(path);
+
+    auto listen_fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        throw std::system_error{errno, std::system_category(), "socket"};
+    }
+    // Create the socket without access for anyone else, rather than
+    // changing its mode after it has been bound
+    auto [dir_fd, sun] = socket_address(path);
+    auto old_umask = ::umask(077);
+    auto res = ::bindat(
+        dir_fd, listen_fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun));
+    auto err = errno;
+    ::umask(old_umask);
+    ::close(dir_fd);
+    if (res < 0) {
+        throw std::system_error{
+            err, std::system_category(), "bind " + path.native()};
+    }
+    if (::listen(listen_fd, SOMAXCONN) < 0) {
+        throw std::system_error{errno, std::system_category(), "listen"};
+    }
+
+    // Workers report exit status to their clients directly so we never need
+    // to wait for them.
+    struct sigaction sa;
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = SA_NOCLDWAIT;
+    ::sigemptyset(&sa.sa_mask);
+    if (::sigaction(SIGCHLD, &sa, nullptr) < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "setting SIGCHLD handler"};
+    }
+
+    OCIJAIL_LOG_INFO(app_) << "serve: listening on " << path;
+    for (;;) {
+        auto conn_fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            throw std::system_error{errno, std::system_category(), "accept"};
+        }
+        // Commands run with our privileges so only our own user may use
+        // them
+        uid_t uid;
+        gid_t gid;
+        if (::getpeereid(conn_fd, &uid, &gid) < 0 || uid != ::geteuid()) {
+            OCIJAIL_LOG_WARN(app_)
+                << "serve: rejecting connection from another user";
+            ::close(conn_fd);
+            continue;
+        }
+        auto pid = ::fork();
+        if (pid < 0) {
+            app_.log_error(std::system_error{
+                errno, std::system_category(), "forking serve worker"});
+        } else if (pid == 0) {
+            ::close(listen_fd);
+            try {
+                handle(conn_fd);
+            } catch (const std::exception& e) {
+                app_.log_error(e);
+                ::_exit(1);
+            }
+            ::_exit(0);
+        }
+        ::close(conn_fd);
+    }
+}
+
+void serve::handle(int conn_fd) {
+    // Restore the default so that we can wait for the command
+    ::signal(SIGCHLD, SIG_DFL);
+
+    std::array<char, max_message_size> buf;
+    std::array<char, CMSG_SPACE(3 * sizeof(int))> cmsg;
+    std::fill_n(cmsg.begin(), cmsg.size(), 0);
+    ::iovec iov{.iov_base = buf.data(), .iov_len = buf.size()};
+    ::msghdr hdr{
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsg.data(),
+        .msg_controllen = cmsg.size(),
+    };
+    auto n = ::recvmsg(conn_fd, &hdr, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "reading daemon request"};
+    }
+    std::vector<int> fds;
+    for (auto m = CMSG_FIRSTHDR(&hdr); m != nullptr; m = CMSG_NXTHDR(&hdr, m)) {
+        if (m->cmsg_level == SOL_SOCKET && m->cmsg_type == SCM_RIGHTS) {
+            auto p = reinterpret_cast<int*>(CMSG_DATA(m));
+            auto count = (m->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            fds.insert(fds.end(), p, p + count);
+        }
+    }
+    if ((hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || fds.size() != 3) {
+        throw std::runtime_error{"malformed daemon request"};
+    }
+    auto request = json::parse(buf.data(), buf.data() + n);
+    std::vector<std::string> args = request["args"];
+    fs::path cwd = request["cwd"];
+
+    auto pid = ::fork();
+    if (pid < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "forking serve command"};
+    }
+    if (pid == 0) {
+        // Run the command with the client's descriptors and working
+        // directory.
+        for (int i = 0; i < 3; i++) {
+            ::dup2(fds[i], i);
+            ::close(fds[i]);
+        }
+        ::close(conn_fd);
+        if (::chdir(cwd.c_str()) < 0) {
+            app_.log_error(std::system_error{
+                errno,
+                std::system_category(),
+                "error changing directory to " + cwd.string()});
+            ::_exit(1);
+        }
+        // Use _exit so that nothing inherited from the daemon, such as its
+        // atexit handlers, runs in the command's process
+        auto status = app_.run(std::move(args));
+        std::cout.flush();
+        std::cerr.flush();
+        ::_exit(status);
+    }
+    for (auto fd : fds) {
+        ::close(fd);
+    }
+
+    int status;
+    if (::waitpid(pid, &status, 0) < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "waiting for serve command"};
+    }
+    json reply;
+    reply["status"] =
+        WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    auto s = reply.dump();
+    if (::send(conn_fd, s.data(), s.size(), 0) < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "writing daemon reply"};
+    }
+}
+
+}  // namespace ocijail
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <optional>
+
+#include "ocijail/main.h"
+
+namespace ocijail {
+
+// Long-lived daemon which keeps main_app resident and executes commands
+// forwarded to it over a local socket in the state database.
+//
+// Each request is a single SOCK_SEQPACKET message containing a json object
+// with the command line ("args") and working directory ("cwd") of the client,
+// with the client's stdin, stdout and stderr attached using SCM_RIGHTS. The
+// reply is a json object containing the command's exit status ("status").
+struct serve {
+    static void init(main_app& app);
+
+    // If a daemon is listening on the state database selected by the given
+    // command line and the command can be forwarded, run it in the daemon and
+    // return its exit status. Otherwise return std::nullopt and the caller
+    // should run the command itself.
+    static std::optional<int> forward(int argc, char** argv);
+
+    // Location of the daemon socket in the given state database.
+    static std::filesystem::path socket_path(
+        const std::filesystem::path& state_db) {
+        return state_db / ".serve.sock";
+    }
+
+   private:
+    serve(main_app& app);
+    void run();
+    void handle(int conn_fd);
+
+    main_app& app_;
+    std::optional<std::filesystem::path> socket_;
+};
+
+}  // namespace ocijail
@@ -27,21 +27,22 @@ start::start(main_app& app) : app_(app) {
 }
 
 void start::run() {
+    auto span = app_.trace("start", {{"id", id_}});
     auto state = app_.get_runtime_state(id_);
     auto lk = state.lock();
     state.load();
 
-    if (state["status"] != "created") {
+    if (state.status() != container_status::CREATED) {
         std::stringstream ss;
-        ss << "start: container not in \"created\" state (currently "
-           << state["status"] << ")";
+        ss << "start: container not in \"created\" state (currently \""
+           << status_name(state.status()) << "\")";
         throw std::runtime_error(ss.str());
     }
-    state["status"] = "running";
-    state.save();
+    state.update_status(container_status::RUNNING);
 
-    auto& config_hooks = state["config"]["hooks"];
-    hook::run_hooks(app_, config_hooks, "prestart", state);
+    // Only the hooks are needed from the bundle config
+    auto& config_hooks = state.config().hooks;
+    hook::run_hooks(app_, config_hooks.prestart, "prestart", state);
 
     auto start_wait = state.get_state_dir() / "start_wait";
     auto fd = ::open(start_wait.c_str(), O_RDWR);
@@ -59,7 +60,7 @@ void start::run() {
 
     // Somehow sync with executing the container process before
     // running poststart hooks?
-    hook::run_hooks(app_, config_hooks, "poststart", state);
+    hook::run_hooks(app_, config_hooks.poststart, "poststart", state);
 }
 
 }  // namespace ocijail
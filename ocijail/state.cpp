@@ -1,4 +1,5 @@
 #include <signal.h>
+#include <algorithm>
 #include <iostream>
 
 #include "nlohmann/json.hpp"
@@ -18,20 +19,62 @@ void state::init(main_app& app) {
 state::state(main_app& app) : app_(app) {
     auto sub = app.add_subcommand(
         "state", "Get the state of the container with the given id");
-    sub->add_option("container-id", id_, "Unique identifier for the container")
-        ->required();
+    auto ids_opt = sub->add_option(
+        "container-id",
+        ids_,
+        "Unique identifier for the container. If more than one is given, an "
+        "array of states is printed");
+    auto all_opt =
+        sub->add_flag("--all,-a", all_, "Print the states of all containers");
+    ids_opt->excludes(all_opt);
+    sub->require_option(1);
     sub->final_callback([this] { run(); });
 }
 
 void state::run() {
-    auto state = app_.get_runtime_state(id_);
-    auto lk = state.lock();
-    state.load();
+    if (ids_.size() == 1) {
+        auto state = app_.get_runtime_state(ids_[0]);
+        state.load_snapshot();
 
-    // update state
-    state.check_status();
+        // update state
+        state.check_status();
 
-    std::cout << state.report();
+        std::cout << state.report();
+        return;
+    }
+
+    if (all_) {
+        for (const auto& it : fs::directory_iterator{app_.get_state_db()}) {
+            if (it.is_directory()) {
+                ids_.push_back(it.path().filename().native());
+            }
+        }
+        std::sort(ids_.begin(), ids_.end());
+    }
+
+    // Report every container we can read, logging any which we can't.
+    // Containers deleted since we listed the state database are skipped.
+    json res = json::array();
+    size_t failed = 0;
+    for (auto& id : ids_) {
+        auto state = app_.get_runtime_state(id);
+        if (all_ && !state.exists()) {
+            continue;
+        }
+        try {
+            state.load_snapshot();
+            state.check_status();
+            res.push_back(state.report());
+        } catch (const std::exception& e) {
+            app_.log_error(e);
+            failed++;
+        }
+    }
+    std::cout << res;
+    if (failed) {
+        throw std::runtime_error("state: failed to read " +
+                                 std::to_string(failed) + " containers");
+    }
 }
 
 }  // namespace ocijail
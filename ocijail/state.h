@@ -1,6 +1,7 @@
 #pragma once
 
 #include <optional>
+#include <vector>
 
 #include "ocijail/main.h"
 
@@ -14,7 +15,8 @@ struct state {
     void run();
 
     main_app& app_;
-    std::string id_;
+    std::vector<std::string> ids_;
+    bool all_{false};
 };
 
 }  // namespace ocijail
@@ -0,0 +1,84 @@
+#include <fcntl.h>
+#include <pthread_np.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ctime>
+#include <system_error>
+
+#include "ocijail/trace.h"
+
+using nlohmann::json;
+
+namespace ocijail {
+
+tracer::~tracer() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+void tracer::open(const std::filesystem::path& path) {
+    fd_ = ::open(
+        path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd_ < 0) {
+        throw std::system_error{
+            errno, std::system_category(), "opening " + path.native()};
+    }
+    struct stat st;
+    if (::fstat(fd_, &st) == 0 && st.st_size == 0) {
+        ::write(fd_, "[\n", 2);
+    }
+}
+
+void tracer::close() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+int64_t tracer::now() {
+    ::timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void tracer::record(const std::string& name,
+                    int64_t start,
+                    int64_t end,
+                    const json& args) {
+    json ev;
+    ev["name"] = name;
+    ev["cat"] = "ocijail";
+    ev["ph"] = "X";
+    ev["ts"] = start;
+    ev["dur"] = end - start;
+    ev["pid"] = ::getpid();
+    // Spans from worker threads overlap so each thread needs its own track
+    ev["tid"] = ::pthread_getthreadid_np();
+    if (!args.is_null()) {
+        ev["args"] = args;
+    }
+    // Arguments may hold paths which aren't valid UTF-8 and this runs from
+    // the trace_span destructor, so it must not throw
+    auto s = ev.dump(-1, ' ', false, json::error_handler_t::replace) + ",\n";
+    ::write(fd_, s.data(), s.size());
+}
+
+trace_span::trace_span(tracer& t, std::string name, json args) {
+    if (t.enabled()) {
+        tracer_ = &t;
+        name_ = std::move(name);
+        args_ = std::move(args);
+        start_ = tracer::now();
+    }
+}
+
+void trace_span::end() {
+    if (tracer_) {
+        tracer_->record(name_, start_, tracer::now(), args_);
+        tracer_ = nullptr;
+    }
+}
+
+}  // namespace ocijail
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+#include "nlohmann/json.hpp"
+
+namespace ocijail {
+
+// Records timed spans in the Chrome trace-event format. Each completed span
+// is appended to the trace file with a single write so that spans from
+// forked children and from later invocations can share the file. The file
+// is a json array which is left open, as permitted by the format.
+class tracer {
+   public:
+    tracer() = default;
+    tracer(const tracer&) = delete;
+    ~tracer();
+
+    void open(const std::filesystem::path& path);
+    void close();
+    bool enabled() const { return fd_ >= 0; }
+
+    // Microseconds on the monotonic clock, which is shared by all processes
+    static int64_t now();
+
+    void record(const std::string& name,
+                int64_t start,
+                int64_t end,
+                const nlohmann::json& args);
+
+   private:
+    int fd_{-1};
+};
+
+// A span which is recorded when it ends or goes out of scope. If tracing is
+// disabled, this does nothing.
+class trace_span {
+   public:
+    trace_span(tracer& t, std::string name, nlohmann::json args = nullptr);
+    trace_span(const trace_span&) = delete;
+    ~trace_span() { end(); }
+
+    void end();
+    // Discard the span without recording it, e.g. in a forked child
+    void cancel() { tracer_ = nullptr; }
+
+   private:
+    tracer* tracer_{nullptr};
+    std::string name_;
+    nlohmann::json args_;
+    int64_t start_{0};
+};
+
+}  // namespace ocijail
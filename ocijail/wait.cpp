@@ -0,0 +1,50 @@
+#include <sys/wait.h>
+#include <iostream>
+
+#include "nlohmann/json.hpp"
+
+#include "ocijail/events.h"
+#include "ocijail/wait.h"
+
+using nlohmann::json;
+
+namespace ocijail {
+
+void wait_::init(main_app& app) {
+    static wait_ instance{app};
+}
+
+wait_::wait_(main_app& app) : app_(app) {
+    auto sub = app.add_subcommand(
+        "wait",
+        "Wait for the container with the given id to stop and print its exit "
+        "code");
+    sub->add_option("container-id", id_, "Unique identifier for the container")
+        ->required();
+    sub->final_callback([this] { run(); });
+}
+
+void wait_::run() {
+    if (!app_.get_runtime_state(id_).exists()) {
+        throw std::runtime_error("container " + id_ + " not found");
+    }
+
+    state_watcher watcher{app_, id_};
+    std::optional<state_watcher::transition> last;
+    watcher.run([&](const auto& t) {
+        last = t;
+        return t.status && *t.status != container_status::STOPPED;
+    });
+    if (!last->status) {
+        throw std::runtime_error("container " + id_ +
+                                 " was deleted while waiting");
+    }
+
+    // The exit code is -1 if the container was not monitored and we could
+    // not observe its exit.
+    auto res = transition_json(*last);
+    std::cout << (res.contains("exitCode") ? res["exitCode"].get<int>() : -1)
+              << "\n";
+}
+
+}  // namespace ocijail
@@ -166,6 +166,44 @@ class test_create(unittest.TestCase):
             pre_check=lambda dir: os.mkdir(os.path.join(dir, "root"))
         )
 
+    def test_root(self):
+        # if present, root must be an object with a string path and a
+        # boolean readonly
+        c = self.config()
+        c["root"] = "broken"
+        self.check_bad_config(c)
+        c["root"] = {"path": 42}
+        self.check_bad_config(c)
+        c["root"] = {"path": "/tmp", "readonly": "yes"}
+        self.check_bad_config(c)
+        c["root"] = {"path": "/tmp", "readonly": False}
+        self.check_good_config(c)
+
+    def test_hostname(self):
+        # if present, hostname must be a string
+        c = self.config()
+        c["hostname"] = 42
+        self.check_bad_config(c)
+        c["hostname"] = "test"
+        self.check_good_config(c)
+
+    def test_annotations(self):
+        # if present, annotations must be an object with string values
+        c = self.config()
+        c["annotations"] = []
+        self.check_bad_config(c)
+        c["annotations"] = {"org.example": 42}
+        self.check_bad_config(c)
+        c["annotations"] = {"org.example": "value"}
+        self.check_good_config(c)
+
+    def test_unknown_fields(self):
+        # Fields we don't use are ignored, whatever their type
+        c = self.config()
+        c["linux"] = {"namespaces": [{"type": "pid"}], "maskedPaths": 42}
+        c["process"]["capabilities"] = "anything"
+        self.check_good_config(c)
+
     def test_mounts(self):
         # if present, mounts must be an array of objects
         c = self.config()
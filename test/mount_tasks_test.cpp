@@ -0,0 +1,232 @@
+// Tests for the mount scheduler, using a fake in place of nmount and unmount
+// so that they run on any platform and without privileges.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ocijail/mount_tasks.h"
+
+using namespace ocijail;
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAIL: " << what << "\n";
+        failures++;
+    }
+}
+
+struct fake_mount {
+    const char* destination;
+    // The resolved path, or null if resolving failed
+    const char* resolved;
+    bool nullfs = false;
+};
+
+std::vector<mount_task> make_tasks(const std::vector<fake_mount>& mounts) {
+    std::vector<mount_task> tasks;
+    for (auto& m : mounts) {
+        auto& task = tasks.emplace_back();
+        task.mount = nullptr;
+        task.destination = m.destination;
+        task.nullfs = m.nullfs;
+        if (m.resolved) {
+            task.resolved.path = m.resolved;
+        } else {
+            task.barrier = true;
+        }
+    }
+    link_mount_tasks(tasks);
+    return tasks;
+}
+
+bool depends_on(const mount_task& task, size_t i) {
+    auto& deps = task.dependencies;
+    return std::find(deps.begin(), deps.end(), i) != deps.end();
+}
+
+// Records the order in which a fake backend starts and finishes tasks
+class recorder {
+   public:
+    explicit recorder(std::vector<mount_task>& tasks)
+        : tasks_(tasks),
+          started_(tasks.size(), -1),
+          finished_(tasks.size(), -1) {}
+
+    void run(mount_task& task, const std::set<size_t>& failing = {}) {
+        auto i = size_t(&task - tasks_.data());
+        {
+            std::lock_guard lk{mutex_};
+            started_[i] = clock_++;
+            peak_ = std::max(peak_, ++running_);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        {
+            std::lock_guard lk{mutex_};
+            finished_[i] = clock_++;
+            running_--;
+        }
+        if (failing.contains(i)) {
+            throw std::runtime_error("mount " + std::to_string(i));
+        }
+    }
+
+    bool ran(size_t i) const { return started_[i] >= 0; }
+    bool before(size_t a, size_t b) const {
+        return finished_[a] >= 0 && started_[b] >= 0 &&
+               finished_[a] < started_[b];
+    }
+    int peak() const { return peak_; }
+
+   private:
+    std::vector<mount_task>& tasks_;
+    std::mutex mutex_;
+    int clock_ = 0;
+    int running_ = 0;
+    int peak_ = 0;
+    std::vector<int> started_;
+    std::vector<int> finished_;
+};
+
+void test_dependencies() {
+    auto tasks = make_tasks({
+        {"/a", "/r/a"},
+        {"/a/b", "/r/a/b"},
+        {"/c", "/r/c"},
+        // Resolves to the same place as /c through a symbolic link
+        {"/d", "/r/c"},
+        {"/e", "/r/e"},
+    });
+    check(depends_on(tasks[1], 0), "nested mount waits for its parent");
+    check(tasks[2].dependencies.empty(), "unrelated mount doesn't wait");
+    check(depends_on(tasks[3], 2), "mounts resolving together are ordered");
+    check(tasks[4].dependencies.empty(), "independent mount doesn't wait");
+    check(tasks[0].dependents == std::vector<size_t>{1},
+          "dependents mirror dependencies");
+}
+
+void test_barriers() {
+    auto tasks = make_tasks({
+        {"/a", "/r/a", true},
+        {"/b", "/r/b"},
+        // May follow links from the nullfs source so waits for everything
+        {"/a/c", "/r/a/c"},
+        {"/d", "/r/d"},
+        // Couldn't be resolved, so waits for everything
+        {"/f", nullptr},
+        {"/g", "/r/g"},
+    });
+    check(depends_on(tasks[2], 0) && depends_on(tasks[2], 1),
+          "mount under nullfs waits for all earlier mounts");
+    check(depends_on(tasks[3], 2), "later mounts wait for a barrier");
+    for (size_t i = 0; i < 4; i++) {
+        check(depends_on(tasks[4], i),
+              "unresolved mount waits for mount " + std::to_string(i));
+    }
+    check(depends_on(tasks[5], 4), "later mounts wait for unresolved mount");
+}
+
+void test_order(bool reverse) {
+    auto tasks = make_tasks({
+        {"/a", "/r/a"},
+        {"/a/b", "/r/a/b"},
+        {"/a/b/c", "/r/a/b/c"},
+        {"/x", "/r/x"},
+        {"/y", "/r/y"},
+        {"/y/z", "/r/y/z"},
+        {"/w", "/r/w"},
+    });
+    recorder rec{tasks};
+    run_mount_tasks(tasks, reverse, true, [&](mount_task& t) { rec.run(t); });
+    auto name = std::string{reverse ? "reverse: " : "forward: "};
+    for (size_t j = 0; j < tasks.size(); j++) {
+        check(rec.ran(j), name + "task " + std::to_string(j) + " ran");
+        for (auto i : tasks[j].dependencies) {
+            auto ok = reverse ? rec.before(j, i) : rec.before(i, j);
+            check(ok,
+                  name + "tasks " + std::to_string(i) + " and " +
+                      std::to_string(j) + " ran in order");
+        }
+    }
+    check(rec.peak() > 1, name + "independent tasks ran concurrently");
+}
+
+void test_stop_on_error() {
+    auto tasks = make_tasks({
+        {"/a", "/r/a"},
+        {"/a/b", "/r/a/b"},
+        {"/a/b/c", "/r/a/b/c"},
+    });
+    recorder rec{tasks};
+    std::string error;
+    try {
+        run_mount_tasks(
+            tasks, false, true, [&](mount_task& t) { rec.run(t, {1}); });
+    } catch (const std::runtime_error& e) {
+        error = e.what();
+    }
+    check(error == "mount 1", "error from the failed mount is rethrown");
+    check(rec.ran(0) && rec.ran(1), "mounts up to the failure ran");
+    check(!rec.ran(2), "nothing starts after a failure");
+}
+
+void test_continue_on_error() {
+    auto tasks = make_tasks({
+        {"/a", "/r/a"},
+        {"/a/b", "/r/a/b"},
+        {"/a/b/c", "/r/a/b/c"},
+        {"/x", "/r/x"},
+    });
+    recorder rec{tasks};
+    std::string error;
+    try {
+        run_mount_tasks(
+            tasks, true, false, [&](mount_task& t) { rec.run(t, {2, 1}); });
+    } catch (const std::runtime_error& e) {
+        error = e.what();
+    }
+    // In reverse, /a/b/c is unmounted first
+    check(error == "mount 2", "first error is rethrown");
+    for (size_t i = 0; i < tasks.size(); i++) {
+        check(rec.ran(i),
+              "task " + std::to_string(i) + " ran despite earlier errors");
+    }
+    check(rec.before(2, 1) && rec.before(1, 0),
+          "a failed task still counts as complete");
+}
+
+void test_empty() {
+    std::vector<mount_task> tasks;
+    bool called = false;
+    run_mount_tasks(tasks, false, true, [&](mount_task&) { called = true; });
+    check(!called, "no tasks, no calls");
+}
+
+}  // namespace
+
+int main() {
+    test_dependencies();
+    test_barriers();
+    test_order(false);
+    test_order(true);
+    test_stop_on_error();
+    test_continue_on_error();
+    test_empty();
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "PASS\n";
+    return EXIT_SUCCESS;
+}
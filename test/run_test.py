@@ -11,6 +11,7 @@ import socket
 import subprocess
 import sys
 import tempfile
+import time
 import unittest
 
 cmd = "ocijail/ocijail"
@@ -139,6 +140,115 @@ class test_run(unittest.TestCase):
         ret, _, _ = self.run_with_config(c)
         self.assertEqual(ret, 42)
 
+    def state(self):
+        args = [cmd, "state", self.container_id]
+        ret = subprocess.run(args=args, stdout=subprocess.PIPE)
+        self.assertTrue(ret.returncode == 0)
+        return json.loads(ret.stdout)
+
+    def test_monitor(self):
+        # With a monitor, the container should be reported as stopped once
+        # its process has exited
+        c = self.config()
+        c["process"]["args"] = ["sh", "-c", "exit 42"]
+        c["annotations"] = {"org.freebsd.ocijail.monitor": "true"}
+        ret, _, _ = self.run_with_config(c)
+        self.assertEqual(ret, 42)
+        for i in range(50):
+            if self.state()["status"] == "stopped":
+                break
+            time.sleep(0.1)
+        self.assertEqual(self.state()["status"], "stopped")
+        # Only the monitor records the exit status, which events reports for
+        # a stopped container
+        args = [cmd, "events", self.container_id]
+        with subprocess.Popen(args=args, stdout=subprocess.PIPE) as p:
+            try:
+                ev = json.loads(p.stdout.readline())
+            finally:
+                p.kill()
+        self.assertEqual(ev["status"], "stopped")
+        self.assertEqual(ev["exitCode"], 42)
+
+    def test_wait(self):
+        # Waiting for a monitored container should report its exit code
+        c = self.config()
+        c["process"]["args"] = ["sh", "-c", "exit 42"]
+        c["annotations"] = {"org.freebsd.ocijail.monitor": "true"}
+        ret, _, _ = self.run_with_config(c)
+        self.assertEqual(ret, 42)
+        args = [cmd, "wait", self.container_id]
+        ret = subprocess.run(args=args, stdout=subprocess.PIPE, timeout=10)
+        self.assertEqual(ret.returncode, 0)
+        self.assertEqual(ret.stdout, b"42\n")
+
+    def test_state_all(self):
+        # The batched form of state should include our container
+        c = self.config()
+        c["process"]["args"] = ["sh", "-c", "exit 0"]
+        ret, _, _ = self.run_with_config(c)
+        self.assertEqual(ret, 0)
+        args = [cmd, "state", "--all"]
+        ret = subprocess.run(args=args, stdout=subprocess.PIPE)
+        self.assertEqual(ret.returncode, 0)
+        states = json.loads(ret.stdout)
+        ids = [s["id"] for s in states]
+        self.assertIn(self.container_id, ids)
+
+    def test_serve(self):
+        # Commands forwarded to the daemon should give the same results as
+        # running them directly, without picking up the daemon's own global
+        # options
+        c = self.config()
+        c["process"]["args"] = ["sh", "-c", "exit 0"]
+        ret, _, _ = self.run_with_config(c)
+        self.assertEqual(ret, 0)
+        state_args = [cmd, "state", self.container_id]
+        list_args = [cmd, "list"]
+        direct_state = subprocess.run(args=state_args, stdout=subprocess.PIPE)
+        direct_list = subprocess.run(args=list_args, stdout=subprocess.PIPE)
+        sock_path = "/var/run/ocijail/.serve.sock"
+        with tempfile.TemporaryDirectory() as log_dir:
+            log_path = os.path.join(log_dir, "serve.log")
+            args = [cmd, "--log", log_path, "--log-level", "debug", "serve"]
+            with subprocess.Popen(args=args) as daemon:
+                try:
+                    for i in range(50):
+                        if os.path.exists(sock_path):
+                            break
+                        time.sleep(0.1)
+                    self.assertTrue(os.path.exists(sock_path))
+                    state = subprocess.run(args=state_args, stdout=subprocess.PIPE)
+                    lst = subprocess.run(args=list_args, stdout=subprocess.PIPE)
+                    missing = subprocess.run(
+                        args=[cmd, "state", self.container_id + "_missing"],
+                        stderr=subprocess.PIPE)
+                finally:
+                    daemon.kill()
+                    os.remove(sock_path)
+            self.assertEqual(state.returncode, direct_state.returncode)
+            self.assertEqual(json.loads(state.stdout), json.loads(direct_state.stdout))
+            self.assertEqual(lst.returncode, direct_list.returncode)
+            self.assertEqual(lst.stdout, direct_list.stdout)
+            # The error goes to the client, not the daemon's log file
+            self.assertNotEqual(missing.returncode, 0)
+            self.assertIn(b"not found", missing.stderr)
+            with open(log_path) as f:
+                self.assertNotIn("not found", f.read())
+
+    def test_metrics(self):
+        # Running a container should be reflected in the metrics
+        c = self.config()
+        c["process"]["args"] = ["sh", "-c", "exit 0"]
+        ret, _, _ = self.run_with_config(c)
+        self.assertEqual(ret, 0)
+        args = [cmd, "metrics"]
+        ret = subprocess.run(args=args, stdout=subprocess.PIPE)
+        self.assertEqual(ret.returncode, 0)
+        out = ret.stdout.decode("utf-8")
+        self.assertIn('ocijail_commands_total{command="create",outcome="success"}', out)
+        self.assertIn('ocijail_commands_total{command="start",outcome="success"}', out)
+
     def test_stdout(self):
         c = self.config()
         c["process"]["args"] = ["echo", "Hello", "World"]
@@ -352,6 +462,49 @@ class test_run(unittest.TestCase):
             # before we delete root_dir
             self.delete()
 
+    def test_concurrent_mounts(self):
+        # Mounts are made on several threads. Nested mounts, including one
+        # nested via a symlink, must wait for their parents while
+        # independent mounts go ahead.
+        with tempfile.TemporaryDirectory() as root_dir, \
+             tempfile.TemporaryDirectory() as data_dir, \
+             tempfile.TemporaryDirectory() as nested_dir, \
+             tempfile.TemporaryDirectory() as linked_dir:
+            shutil.copytree("/rescue", os.path.join(root_dir, "rescue"))
+            os.mkdir(os.path.join(root_dir, "run"))
+            os.mkdir(os.path.join(root_dir, "var"))
+            os.symlink("/run", os.path.join(root_dir, "var/run"))
+            for d, name in [(data_dir, "a"), (nested_dir, "b"), (linked_dir, "c")]:
+                with open(os.path.join(d, name), "w") as f:
+                    f.write(name + "\n")
+            c = self.config()
+            c["root"]["path"] = root_dir
+            c["process"]["args"] = [
+                "sh", "-c",
+                "cat /data/a /data/nested/b /run/x/c/c && touch /t1/f /t2/f /t3/f"]
+            c["process"]["env"] = ["PATH=/rescue"]
+            c["mounts"] = [
+                {"type": "tmpfs", "destination": "/t1"},
+                {"type": "nullfs", "destination": "/data", "source": data_dir},
+                {"type": "tmpfs", "destination": "/t2"},
+                {"type": "nullfs", "destination": "/data/nested", "source": nested_dir},
+                {"type": "tmpfs", "destination": "/var/run/x"},
+                {"type": "nullfs", "destination": "/run/x/c", "source": linked_dir},
+                {"type": "tmpfs", "destination": "/t3"},
+            ]
+            ret, out, _ = self.run_with_config(c)
+            self.assertEqual(ret, 0)
+            self.assertEqual(out, "a\nb\nc\n")
+            # Delete the container so that everything is unmounted before we
+            # delete the directories
+            self.delete()
+            # The files written to the tmpfs mounts went with them, and the
+            # mount points which we created have been removed
+            for d in ["t1", "t2", "t3", "run/x"]:
+                self.assertFalse(os.path.exists(os.path.join(root_dir, d)))
+            self.assertFalse(os.path.exists(os.path.join(data_dir, "nested")))
+            self.assertTrue(os.path.exists(os.path.join(root_dir, "run")))
+
     def test_readonly_root(self):
         # Running the container should not modify the root
         with tempfile.TemporaryDirectory() as root_dir: